@@ -0,0 +1,81 @@
+//
+// STL allocator over the arenas of the uthreads library.
+//
+
+#ifndef THREADS_ARENAALLOCATOR_H
+#define THREADS_ARENAALLOCATOR_H
+
+#include "uthreads.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/*
+ * Allocator that takes memory from the arena of the calling thread (see uthread_arena_alloc),
+ * for containers that live as long as a request, e.g.
+ *     std::vector<int, ArenaAllocator<int>> ids;
+ * Deallocating does nothing; the memory is released when the thread terminates. All instances
+ * are equal, since they all allocate from whichever thread calls them, so a container should
+ * only grow on the thread that created it, and must not outlive that thread.
+ */
+template <class T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	/**
+	 * Default constructor for an arena allocator.
+	 */
+	ArenaAllocator() noexcept
+	{
+	}
+
+	/**
+	 * Converting constructor, for containers that allocate their nodes.
+	 */
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U> &) noexcept
+	{
+	}
+
+	/**
+	 * Allocate room for n objects of type T.
+	 * @throws std::bad_alloc if the arena has no room for them.
+	 */
+	T *allocate(std::size_t n)
+	{
+		if (n > SIZE_MAX / sizeof(T))
+		{
+			throw std::bad_alloc();
+		}
+		void *memory = uthread_arena_alloc(n * sizeof(T), alignof(T));
+		if (memory == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return static_cast<T *>(memory);
+	}
+
+	/**
+	 * Do nothing: arena memory is only released with the whole arena.
+	 */
+	void deallocate(T *, std::size_t) noexcept
+	{
+	}
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) noexcept
+{
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) noexcept
+{
+	return false;
+}
+
+
+#endif //THREADS_ARENAALLOCATOR_H
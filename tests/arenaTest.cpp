@@ -0,0 +1,178 @@
+//
+// Test for the per-thread arenas of the uthreads library.
+//
+// Worker threads build containers on their arenas through ArenaAllocator while the timer
+// preempts them, check their contents, make allocations bigger than a chunk and with large
+// alignments, and terminate. A thread reusing a parked worker must start with a released arena,
+// also after pinning has faulted the parked stacks in again.
+// Also compares the cost of small allocations from the arena and from malloc.
+//
+
+#include "uthreads.h"
+#include "arenaAllocator.h"
+#include "testUtils.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+#define NUM_OF_WORKERS 16
+#define ROUNDS 200
+#define ELEMENTS 500
+#define BIG_ALLOCATION (16 << 20) /* bytes, more than the largest chunk */
+#define TIMED_ALLOCATIONS 1000000
+#define TIMED_SIZE 48 /* bytes */
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+typedef std::map<int, ArenaString, std::less<int>,
+				 ArenaAllocator<std::pair<const int, ArenaString>>> ArenaMap;
+
+static std::atomic<int> workersLeft;
+static long workerArenaBytes;
+
+/**
+ * Bytes mapped for the arena of the calling thread.
+ */
+static long arenaBytes()
+{
+	uthread_stats stats;
+	check(uthread_get_stats(uthread_get_tid(), &stats) == 0, "get_stats failed");
+	return stats.arena_bytes;
+}
+
+/**
+ * Entry point of the workers.
+ */
+static void worker()
+{
+	int self = uthread_get_tid();
+	// Avoid malloc, which is not safe to preempt:
+	char selfName[32];
+	snprintf(selfName, sizeof(selfName), "thread %d", self);
+	for (int round = 0; round < ROUNDS; ++round)
+	{
+		std::vector<int, ArenaAllocator<int>> numbers;
+		ArenaMap names;
+		for (int i = 0; i < ELEMENTS; ++i)
+		{
+			numbers.push_back(self * i + round);
+			names[i] = selfName;
+		}
+		long long sum = 0;
+		for (int number : numbers)
+		{
+			sum += number;
+		}
+		long long expected = (long long) self * ELEMENTS * (ELEMENTS - 1) / 2 +
+							 (long long) round * ELEMENTS;
+		check(sum == expected, "a vector on the arena was corrupted");
+		check(names.size() == ELEMENTS && names[0] == selfName &&
+			  names[ELEMENTS - 1] == selfName, "a map on the arena was corrupted");
+	}
+
+	for (size_t alignment = 1; alignment <= 4096; alignment *= 2)
+	{
+		void *memory = uthread_arena_alloc(3, alignment);
+		check(memory != nullptr && (uintptr_t) memory % alignment == 0, "bad arena alignment");
+	}
+	auto big = (char *) uthread_arena_alloc(BIG_ALLOCATION, 64);
+	check(big != nullptr, "big arena allocation failed");
+	memset(big, self, BIG_ALLOCATION);
+	check(big[0] == (char) self && big[BIG_ALLOCATION - 1] == (char) self,
+		  "big allocation corrupted");
+	check(arenaBytes() > BIG_ALLOCATION, "the arena does not count the big allocation");
+
+	workerArenaBytes = arenaBytes();
+	--workersLeft;
+	uthread_terminate(self);
+}
+
+/**
+ * Entry point of the thread that reuses a parked worker.
+ */
+static void reuser()
+{
+	check(arenaBytes() < workerArenaBytes, "a reused thread kept the arena of the old one");
+	check(uthread_arena_alloc(1, 1) != nullptr, "allocating from a reused arena failed");
+	--workersLeft;
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Time small allocations from the arena of the calling thread, in nanoseconds each.
+ */
+static double timeArena()
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < TIMED_ALLOCATIONS; ++i)
+	{
+		auto memory = (volatile char *) uthread_arena_alloc(TIMED_SIZE, alignof(long));
+		*memory = (char) i;
+	}
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count() /
+		   TIMED_ALLOCATIONS;
+}
+
+/**
+ * Time the same allocations from malloc, each freed, in nanoseconds each. Call it only when the
+ * library is shut down, since a thread switch in the middle of malloc would deadlock on its lock.
+ */
+static double timeMalloc()
+{
+	typedef std::chrono::steady_clock Clock;
+	std::vector<void *> blocks(TIMED_ALLOCATIONS);
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < TIMED_ALLOCATIONS; ++i)
+	{
+		blocks[i] = malloc(TIMED_SIZE);
+		*(volatile char *) blocks[i] = (char) i;
+	}
+	for (void *block : blocks)
+	{
+		free(block);
+	}
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count() /
+		   TIMED_ALLOCATIONS;
+}
+
+int main()
+{
+	int quantum = 1000;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	check(uthread_set_pool_capacity(NUM_OF_WORKERS) == 0, "set_pool_capacity failed");
+	check(uthread_arena_alloc(8, 3) == nullptr, "allocating with a bad alignment succeeded");
+	check(arenaBytes() == 0, "the arena was mapped before it was used");
+
+	workersLeft = NUM_OF_WORKERS;
+	for (int i = 0; i < NUM_OF_WORKERS; ++i)
+	{
+		check(uthread_spawn(worker, 0) >= 0, "spawn failed");
+	}
+	while (workersLeft > 0)
+	{
+		uthread_yield();
+	}
+	// Pinning drops the contents of the parked workers' stacks, which the reuser starts on:
+	check(uthread_set_affinity(sched_getcpu()) == 0, "set_affinity failed");
+	workersLeft = 1;
+	check(uthread_spawn(reuser, 0) >= 0, "spawn failed");
+	while (workersLeft > 0)
+	{
+		uthread_yield();
+	}
+
+	double arenaNanos = timeArena();
+	check(uthread_shutdown() == 0, "shutdown failed");
+	printf("%d allocations of %d bytes: arena %.1f ns each, malloc and free %.1f ns each\n",
+		   TIMED_ALLOCATIONS, TIMED_SIZE, arenaNanos, timeMalloc());
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
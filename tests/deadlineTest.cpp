@@ -0,0 +1,134 @@
+//
+// Test for the deadline scheduling class of the uthreads library.
+//
+// A READY thread taken out of the class, while another deadline thread runs, must still be
+// scheduled. A deadline thread that keeps giving up the cpu after short runs must be throttled
+// once its runs add up to its budget, and so must one that spins without giving it up.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+#define QUANTUM_USECS 100000
+#define MAIN_DEADLINE_USECS 10
+#define MAIN_BUDGET_USECS 1000000
+#define LONG_DEADLINE_USECS 1000000
+#define BUDGET_USECS 1000
+#define SHORT_RUN_USECS 20
+#define MAX_YIELDS 1000
+#define MAX_SPIN_USECS 2000000 /* cpu time after which a spinning thread was never throttled */
+
+static volatile bool mainRan;
+static volatile int runs;
+static long long spun;
+
+/**
+ * Get the cpu time of the calling kernel thread, in microseconds.
+ */
+static long long cpuUsecs()
+{
+	timespec now{};
+	check(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0, "clock_gettime failed");
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Use usecs of cpu time.
+ */
+static void spin(long long usecs)
+{
+	long long start = cpuUsecs();
+	while (cpuUsecs() - start < usecs)
+	{
+	}
+	spun += usecs;
+	check(spun < MAX_SPIN_USECS, "a deadline thread was never throttled");
+}
+
+/**
+ * Entry point of the thread that is taken out of the deadline class.
+ */
+static void counter()
+{
+	while (true)
+	{
+		++runs;
+		uthread_yield();
+	}
+}
+
+/**
+ * Entry point of the deadline thread that runs briefly and yields, until the main thread runs.
+ */
+static void yielder()
+{
+	while (!mainRan)
+	{
+		spin(SHORT_RUN_USECS);
+		uthread_yield();
+	}
+	uthread_terminate(uthread_get_tid());
+}
+
+#ifndef UTHREADS_COOPERATIVE
+/**
+ * Entry point of the deadline thread that spins without yielding, until the main thread runs.
+ */
+static void spinner()
+{
+	while (!mainRan)
+	{
+		spin(SHORT_RUN_USECS);
+	}
+	uthread_terminate(uthread_get_tid());
+}
+#endif
+
+/**
+ * Let a new deadline thread with a budget of BUDGET_USECS run, and check that the main thread
+ * gets the cpu back once the thread used up about its budget.
+ */
+static void checkThrottled(void (*entry)(), const char *what)
+{
+	mainRan = false;
+	spun = 0;
+	int tid = uthread_spawn(entry, 0);
+	check(tid > 0 && uthread_set_deadline(tid, LONG_DEADLINE_USECS, BUDGET_USECS) == 0, what);
+	mainRan = true;
+	check(spun >= BUDGET_USECS / 2, "a deadline thread was throttled before using its budget");
+	uthread_yield();
+}
+
+int main()
+{
+	int quantum = QUANTUM_USECS;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+
+	// The counter's deadline is later than main's, so it waits in the deadline heap until it
+	// leaves the class:
+	int tid = uthread_spawn(counter, 0);
+	check(tid > 0, "spawn failed");
+	check(uthread_set_deadline(0, MAIN_DEADLINE_USECS, MAIN_BUDGET_USECS) == 0 &&
+		  uthread_set_deadline(tid, LONG_DEADLINE_USECS, MAIN_BUDGET_USECS) == 0,
+		  "set_deadline failed");
+	check(uthread_set_deadline(tid, 0, 0) == 0 && uthread_set_deadline(0, 0, 0) == 0,
+		  "leaving the deadline class failed");
+	for (int i = 0; i < MAX_YIELDS && runs == 0; ++i)
+	{
+		uthread_yield();
+	}
+	check(runs > 0, "a thread that left the deadline class never ran again");
+	check(uthread_terminate(tid) == 0, "terminate failed");
+
+	checkThrottled(yielder, "setting a yielding thread's deadline failed");
+#ifndef UTHREADS_COOPERATIVE
+	checkThrottled(spinner, "setting a spinning thread's deadline failed");
+#endif
+
+	check(uthread_shutdown() == 0, "shutdown failed");
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
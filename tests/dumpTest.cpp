@@ -0,0 +1,212 @@
+//
+// Test for the thread dump of the uthreads library.
+//
+// Puts threads in known places (blocked in a named function, waiting for a mutex held by the
+// main thread), dumps them to a file and looks for the expected lines and frames. Then does the
+// same with a dump requested by signal: written when a thread yields, when the signal interrupts
+// the sleep of a process whose threads all wait, and, by address only, when a quantum expires
+// while threads spin without yielding.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SIGNAL_DELAY_USECS 20000 /* time the main thread sleeps before the dump signal arrives */
+#define SPIN_QUANTUM_USECS 10000
+#define MAX_SPIN_SECS 2 /* cpu time the threads spin for before the dump is given up on */
+
+static int mutex;
+static volatile bool stopSpinning;
+
+/**
+ * Read all of a file back.
+ */
+static std::string readAll(FILE *file)
+{
+	std::string text;
+	char buffer[4096];
+	rewind(file);
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		text.append(buffer, length);
+	}
+	return text;
+}
+
+/**
+ * Block the calling thread, in a frame the dump should show.
+ */
+__attribute__((noinline)) void parkedInWorker()
+{
+	uthread_block(uthread_get_tid());
+}
+
+/**
+ * Entry point of the thread that blocks itself.
+ */
+static void blocker()
+{
+	parkedInWorker();
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the thread that waits for the mutex.
+ */
+static void locker()
+{
+	uthread_mutex_lock(mutex);
+	uthread_mutex_unlock(mutex);
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Have the dump signal arrive while the main thread, the only one not blocked, waits for the
+ * dump's own output, and check that the dump ends the wait.
+ */
+static void checkDumpWhileSleeping()
+{
+	int output[2];
+	checkSystem(pipe(output) == 0, "pipe failed");
+	int savedStderr = dup(STDERR_FILENO);
+	dup2(output[1], STDERR_FILENO);
+	fcntl(output[0], F_SETFL, O_NONBLOCK);
+	pid_t child = fork();
+	checkSystem(child >= 0, "fork failed");
+	if (child == 0)
+	{
+		usleep(SIGNAL_DELAY_USECS);
+		kill(getppid(), SIGUSR1);
+		// Without a dump, end the wait anyway, for the check to fail:
+		sleep(MAX_SPIN_SECS);
+		static const char timeout[] = "no dump\n";
+		write(STDERR_FILENO, timeout, sizeof(timeout) - 1);
+		_exit(EXIT_SUCCESS);
+	}
+	check(uthread_wait_fd(output[0], POLLIN) == POLLIN, "wait_fd failed");
+	kill(child, SIGKILL);
+	waitpid(child, nullptr, 0);
+	dup2(savedStderr, STDERR_FILENO);
+	char text[64] = {};
+	check(read(output[0], text, sizeof(text) - 1) > 0, "read failed");
+	check(strncmp(text, "uthreads: 3 threads", strlen("uthreads: 3 threads")) == 0,
+		  "signal did not trigger a dump while the threads waited");
+	close(output[0]);
+	close(output[1]);
+	close(savedStderr);
+}
+
+#ifndef UTHREADS_COOPERATIVE
+/**
+ * Entry point of the thread that spins without yielding.
+ */
+static void spinner()
+{
+	while (!stopSpinning)
+	{
+	}
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Have the dump signal arrive while the threads spin without yielding, and check that the dump is
+ * written when a quantum expires.
+ */
+static void checkDumpWhileSpinning()
+{
+	check(uthread_set_adaptive_quantum(SPIN_QUANTUM_USECS, SPIN_QUANTUM_USECS) == 0,
+		  "set_adaptive_quantum failed");
+	int spinning = uthread_spawn(spinner, 0);
+	check(spinning > 0, "spawn failed");
+	uthread_yield();
+	FILE *errors = tmpfile();
+	int savedStderr = dup(STDERR_FILENO);
+	dup2(fileno(errors), STDERR_FILENO);
+	raise(SIGUSR1);
+	struct stat written = {};
+	while (fstat(fileno(errors), &written) == 0 && written.st_size == 0 &&
+		   clock() < MAX_SPIN_SECS * CLOCKS_PER_SEC)
+	{
+	}
+	stopSpinning = true;
+	dup2(savedStderr, STDERR_FILENO);
+	close(savedStderr);
+	std::string text = readAll(errors);
+	fputs(text.c_str(), stdout);
+	check(text.find("running (addresses only)") != std::string::npos,
+		  "signal did not trigger a dump while the threads spun");
+	check(text.find("thread " + std::to_string(spinning) + ": ") != std::string::npos,
+		  "spinning thread not shown");
+	check(text.find("    #0 0x") != std::string::npos, "no frames in the dump");
+	fclose(errors);
+	uthread_yield();
+}
+#endif
+
+int main()
+{
+	int quantum = 1000000;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	mutex = uthread_mutex_create();
+	check(uthread_mutex_lock(mutex) == 0, "lock failed");
+	int blocked = uthread_spawn(blocker, 0);
+	int waiting = uthread_spawn(locker, 0);
+	uthread_yield();
+
+	FILE *report = tmpfile();
+	check(report != nullptr, "tmpfile failed");
+	check(uthread_dump(fileno(report)) == 0, "dump failed");
+	std::string text = readAll(report);
+	fputs(text.c_str(), stdout);
+	check(text.find("uthreads: 3 threads") != std::string::npos, "no summary line");
+	check(text.find("thread 0: RUNNING") != std::string::npos, "main thread not running");
+	check(text.find("holding 1 mutexes") != std::string::npos, "held mutex not shown");
+	std::string blockedLine = "thread " + std::to_string(blocked) + ": BLOCKED";
+	size_t blockedAt = text.find(blockedLine);
+	check(blockedAt != std::string::npos, "blocked thread not shown");
+	size_t nextThread = text.find("thread ", blockedAt + blockedLine.size());
+	size_t parkedAt = text.find("parkedInWorker", blockedAt);
+	check(parkedAt != std::string::npos && parkedAt < nextThread,
+		  "backtrace of the blocked thread misses its frame");
+	std::string waitingLine = "thread " + std::to_string(waiting) + ": BLOCKED";
+	check(text.find(waitingLine) != std::string::npos, "waiting thread not shown");
+	check(text.find("waiting for mutex " + std::to_string(mutex)) != std::string::npos,
+		  "awaited mutex not shown");
+	check(uthread_dump(-1) == -1, "dumping to a bad descriptor succeeded");
+	fclose(report);
+
+	// A signal requests a dump to stderr, written when a thread next yields, or sooner:
+	check(uthread_set_dump_signal(SIGVTALRM) == -1, "dumping on the timer signal succeeded");
+	check(uthread_set_dump_signal(SIGUSR1) == 0, "set_dump_signal failed");
+	FILE *errors = tmpfile();
+	int savedStderr = dup(STDERR_FILENO);
+	dup2(fileno(errors), STDERR_FILENO);
+	raise(SIGUSR1);
+	uthread_yield();
+	dup2(savedStderr, STDERR_FILENO);
+	check(readAll(errors).find("uthreads: 3 threads") != std::string::npos,
+		  "signal did not trigger a dump");
+	fclose(errors);
+	checkDumpWhileSleeping();
+#ifndef UTHREADS_COOPERATIVE
+	checkDumpWhileSpinning();
+#endif
+	check(uthread_set_dump_signal(0) == 0, "clearing the dump signal failed");
+
+	check(uthread_mutex_unlock(mutex) == 0, "unlock failed");
+	check(uthread_shutdown() == 0, "shutdown failed");
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
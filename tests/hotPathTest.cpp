@@ -0,0 +1,136 @@
+//
+// Test for the inline fast paths of the uthreads library.
+//
+// Threads check that uthread_get_tid_inline and uthread_resume_inline agree with the library
+// while the timer preempts them, and that resuming a blocked or missing thread still goes to the
+// library. Also compares the cost of the calls with and without the fast paths, and of a yield,
+// which is the switch path a profile-guided build is trained on, and times spawning a thread from
+// the pool, which takes the lowest free ID, and terminating it.
+//
+
+#include "uthreads.h"
+#include "uthreadsInline.h"
+#include "testUtils.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#define NUM_OF_CHECKERS 8
+#define CHECKS 200000
+#define TIMED_CALLS 10000000
+#define TIMED_YIELDS 200000
+#define TIMED_SPAWNS 1000000
+
+static std::atomic<int> checkersLeft;
+
+/**
+ * State of the thread with ID tid in a fresh snapshot.
+ */
+static int stateOf(int tid)
+{
+	uthread_snapshot copy;
+	check(uthread_read_snapshot(nullptr, &copy) == 0, "read_snapshot failed");
+	return copy.threads[tid].state;
+}
+
+/**
+ * Entry point of the checkers: compare the fast paths with the library while being preempted.
+ */
+static void checker()
+{
+	int self = uthread_get_tid();
+	for (int i = 0; i < CHECKS; ++i)
+	{
+		check(uthread_get_tid_inline() == self, "get_tid_inline returned another thread");
+		check(uthread_resume_inline(self) == 0 && uthread_resume_inline(0) == 0,
+			  "resume_inline of a ready thread failed");
+		if (i % 1000 == 0)
+		{
+			uthread_yield();
+		}
+	}
+	--checkersLeft;
+	uthread_terminate(self);
+}
+
+/**
+ * Entry point of the threads that main blocks, and yields to.
+ */
+static void spinner()
+{
+	while (true)
+	{
+		uthread_yield();
+	}
+}
+
+/**
+ * Time calls of a function, in nanoseconds per call.
+ */
+template <class Call>
+static double timeCalls(int calls, Call call)
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < calls; ++i)
+	{
+		call();
+	}
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+}
+
+int main()
+{
+	int quantum = 100;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	check(uthread_get_tid_inline() == 0, "get_tid_inline is not the main thread");
+
+	// Resuming a blocked thread, or one that does not exist, is left to the library:
+	int blocked = uthread_spawn(spinner, 0);
+	check(blocked > 0 && uthread_block(blocked) == 0, "blocking failed");
+	check(stateOf(blocked) == UTHREAD_BLOCKED, "the snapshot does not show the block");
+	check(uthread_resume_inline(blocked) == 0 && stateOf(blocked) == UTHREAD_READY,
+		  "resume_inline did not resume a blocked thread");
+	check(uthread_terminate(blocked) == 0, "terminate failed");
+	check(uthread_resume_inline(blocked) == -1, "resume_inline of a missing thread succeeded");
+
+	checkersLeft = NUM_OF_CHECKERS;
+	for (int i = 0; i < NUM_OF_CHECKERS; ++i)
+	{
+		check(uthread_spawn(checker, 0) > 0, "spawn failed");
+	}
+	while (checkersLeft > 0)
+	{
+		check(uthread_get_tid_inline() == 0, "get_tid_inline returned another thread");
+		uthread_yield();
+	}
+
+	// Time the calls with a quantum long enough not to preempt them:
+	check(uthread_shutdown() == 0, "shutdown failed");
+	quantum = 1000000;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	volatile int sink = 0;
+	double getTid = timeCalls(TIMED_CALLS, [&sink] { sink = uthread_get_tid(); });
+	double getTidInline = timeCalls(TIMED_CALLS, [&sink] { sink = uthread_get_tid_inline(); });
+	double resume = timeCalls(TIMED_CALLS / 10, [&sink] { sink = uthread_resume(0); });
+	double resumeInline = timeCalls(TIMED_CALLS, [&sink] { sink = uthread_resume_inline(0); });
+	check(uthread_spawn(spinner, 0) > 0, "spawn failed");
+	// Each yield of main switches to the spinner and back:
+	double yield = timeCalls(TIMED_YIELDS, [] { uthread_yield(); }) / 2;
+
+	// A spawn takes the lowest free ID, and the thread parked by the last terminate:
+	check(uthread_set_pool_capacity(1) == 0, "set_pool_capacity failed");
+	int first = uthread_spawn(spinner, 0);
+	check(first > 0 && uthread_spawn(spinner, 0) > first && uthread_terminate(first) == 0,
+		  "spawning or terminating failed");
+	check(uthread_spawn(spinner, 0) == first, "spawn did not take the lowest free ID");
+	double spawn = timeCalls(TIMED_SPAWNS, [] { uthread_terminate(uthread_spawn(spinner, 0)); });
+	printf("get_tid %.1f ns, inline %.1f ns; resume of a ready thread %.1f ns, inline %.1f ns; "
+		   "context switch %.1f ns; spawn and terminate %.1f ns\n", getTid, getTidInline, resume,
+		   resumeInline, yield, spawn);
+
+	check(uthread_shutdown() == 0, "shutdown failed");
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
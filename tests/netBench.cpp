@@ -0,0 +1,562 @@
+//
+// End-to-end benchmark of the uthreads library over loopback sockets.
+//
+// A server accepts connections and serves each one on its own thread, and a load generator runs
+// a client per connection that sends requests one at a time and times each response. With
+// --protocol echo the server echoes fixed-size messages, with --protocol http it answers
+// HTTP-like requests with a fixed response. Both sides run in this process: first as uthreads
+// waiting for their sockets with uthread_wait_fd, then, with --baseline, as a pthread per
+// connection and per client doing blocking I/O. Requests per second and latency percentiles are
+// reported for each, and every response is checked.
+//
+// It is built against the library with room for thousands of threads, so a run with 2000
+// connections has 4002 uthreads: the clients, the connections, the acceptor and the main thread.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_REQUESTS 100
+#define QUANTUM_USECS 10000
+#define ECHO_SIZE 64 /* bytes per echo message */
+#define BUFFER_SIZE 1024 /* bytes a connection buffers */
+#define PTHREAD_STACK_SIZE 65536 /* bytes */
+#define NO_ARGUMENT -1
+#define HTTP_REQUEST "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: netBench\r\n\r\n"
+#define HTTP_RESPONSE "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 13\r\n\r\n" \
+					  "Hello, world!"
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * What the server speaks.
+ */
+enum Protocol
+{
+	ECHO,
+	HTTP
+};
+
+static Protocol protocol = ECHO;
+static int numOfConnections = DEFAULT_CONNECTIONS;
+static int requestsPerConnection = DEFAULT_REQUESTS;
+
+/*
+ * Whether the current run is on uthreads, with non-blocking sockets, or on pthreads.
+ */
+static bool onUthreads;
+
+static int listener;
+static sockaddr_in serverAddress;
+
+/*
+ * Latency of every request of the current run, in nanoseconds, by client and request number.
+ */
+static std::vector<long long> latencies;
+
+/*
+ * Clients of the current run that did not finish yet, when the last one finished, and (on
+ * uthreads) threads that did not finish yet and the eventfd the last one signals.
+ */
+static std::atomic<int> clientsLeft;
+static Clock::time_point clientsDone;
+static std::atomic<int> threadsLeft;
+static int doneFd;
+
+/*
+ * Client number and socket of each uthread, by thread ID, set by whoever spawned it (or
+ * NO_ARGUMENT).
+ */
+static int clientOf[MAX_THREAD_NUM];
+static int socketOf[MAX_THREAD_NUM];
+
+/*
+ * The connection threads of a run on pthreads.
+ */
+static std::vector<pthread_t> connectionThreads;
+static pthread_attr_t pthreadAttributes;
+
+/**
+ * On uthreads, wait until fd is ready for events. Sockets block on pthreads, so there is no
+ * need to.
+ */
+static void waitFor(int fd, int events)
+{
+	if (onUthreads)
+	{
+		check(uthread_wait_fd(fd, events) > 0, "wait_fd failed");
+	}
+}
+
+/**
+ * Read what fd has, up to size bytes, waiting for it if there is nothing yet.
+ * @return Number of bytes read, 0 at the end of the stream, or -1 on error.
+ */
+static ssize_t receive(int fd, char *buffer, size_t size)
+{
+	while (true)
+	{
+		ssize_t length = read(fd, buffer, size);
+		if (length >= 0)
+		{
+			return length;
+		}
+		if (errno == EAGAIN)
+		{
+			waitFor(fd, POLLIN);
+		}
+		else if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+}
+
+/**
+ * Read exactly size bytes from fd.
+ * @return false if the stream ended first.
+ */
+static bool receiveAll(int fd, char *buffer, size_t size)
+{
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t length = receive(fd, buffer + done, size - done);
+		if (length <= 0)
+		{
+			return false;
+		}
+		done += (size_t) length;
+	}
+	return true;
+}
+
+/**
+ * Write all of data to fd.
+ */
+static void sendAll(int fd, const char *data, size_t size)
+{
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t length = send(fd, data + done, size - done, MSG_NOSIGNAL);
+		if (length >= 0)
+		{
+			done += (size_t) length;
+		}
+		else if (errno == EAGAIN)
+		{
+			waitFor(fd, POLLOUT);
+		}
+		else
+		{
+			checkSystem(errno == EINTR, "send failed");
+		}
+	}
+}
+
+/**
+ * Serve a connection until the client closes it.
+ */
+static void serve(int fd)
+{
+	char buffer[BUFFER_SIZE];
+	size_t used = 0;
+	while (true)
+	{
+		ssize_t length = receive(fd, buffer + used, sizeof(buffer) - used);
+		if (length <= 0)
+		{
+			break;
+		}
+		if (protocol == ECHO)
+		{
+			sendAll(fd, buffer, (size_t) length);
+			continue;
+		}
+		// Answer every complete request in the buffer:
+		used += (size_t) length;
+		const char *end;
+		while ((end = (const char *) memmem(buffer, used, "\r\n\r\n", 4)) != nullptr)
+		{
+			sendAll(fd, HTTP_RESPONSE, sizeof(HTTP_RESPONSE) - 1);
+			size_t consumed = (size_t) (end - buffer) + 4;
+			memmove(buffer, buffer + consumed, used - consumed);
+			used -= consumed;
+		}
+		check(used < sizeof(buffer), "request too long");
+	}
+	close(fd);
+}
+
+/**
+ * Connect to the server and send it requestsPerConnection requests, one at a time, timing and
+ * checking each response.
+ * @param client Number of the client.
+ */
+static void runClient(int client)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | (onUthreads ? SOCK_NONBLOCK : 0), 0);
+	checkSystem(fd >= 0, "socket failed");
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
+	{
+		checkSystem(errno == EINPROGRESS, "connect failed");
+		waitFor(fd, POLLOUT);
+		int error = 0;
+		socklen_t size = sizeof(error);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+		errno = error;
+		check(error == 0, "connect failed");
+	}
+
+	char request[BUFFER_SIZE];
+	char response[BUFFER_SIZE];
+	const char *expected = request;
+	size_t requestSize = ECHO_SIZE;
+	size_t responseSize = ECHO_SIZE;
+	if (protocol == HTTP)
+	{
+		memcpy(request, HTTP_REQUEST, sizeof(HTTP_REQUEST) - 1);
+		requestSize = sizeof(HTTP_REQUEST) - 1;
+		expected = HTTP_RESPONSE;
+		responseSize = sizeof(HTTP_RESPONSE) - 1;
+	}
+	for (int i = 0; i < requestsPerConnection; ++i)
+	{
+		if (protocol == ECHO)
+		{
+			int length = snprintf(request, sizeof(request), "client %d request %d ", client, i);
+			memset(request + length, '.', ECHO_SIZE - length);
+		}
+		Clock::time_point start = Clock::now();
+		sendAll(fd, request, requestSize);
+		check(receiveAll(fd, response, responseSize), "connection closed by the server");
+		latencies[(size_t) client * requestsPerConnection + i] =
+				std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		check(memcmp(response, expected, responseSize) == 0, "wrong response");
+	}
+	close(fd);
+	if (--clientsLeft == 0)
+	{
+		clientsDone = Clock::now();
+	}
+}
+
+/**
+ * On uthreads, count a finished thread, and wake the main thread after the last one.
+ */
+static void finishThread()
+{
+	if (onUthreads && --threadsLeft == 0)
+	{
+		uint64_t one = 1;
+		checkSystem(write(doneFd, &one, sizeof(one)) == sizeof(one), "write to eventfd failed");
+	}
+}
+
+/**
+ * Take the argument a uthread was spawned with.
+ * @param arguments Arguments by thread ID.
+ */
+static int takeArgument(int arguments[MAX_THREAD_NUM])
+{
+	int tid = uthread_get_tid();
+	// The spawner may have been preempted before it could set the argument:
+	while (arguments[tid] == NO_ARGUMENT)
+	{
+		uthread_yield();
+	}
+	int argument = arguments[tid];
+	arguments[tid] = NO_ARGUMENT;
+	return argument;
+}
+
+/**
+ * Entry point of the connection uthreads.
+ */
+static void connectionEntry()
+{
+	serve(takeArgument(socketOf));
+	finishThread();
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the connection pthreads.
+ */
+static void *connectionThread(void *fd)
+{
+	serve((int) (long) fd);
+	return nullptr;
+}
+
+/**
+ * Accept numOfConnections connections, serving each on a new thread.
+ */
+static void acceptConnections()
+{
+	for (int accepted = 0; accepted < numOfConnections;)
+	{
+		int fd = accept4(listener, nullptr, nullptr, onUthreads ? SOCK_NONBLOCK : 0);
+		if (fd < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				waitFor(listener, POLLIN);
+			}
+			else
+			{
+				checkSystem(errno == EINTR, "accept failed");
+			}
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (onUthreads)
+		{
+			int tid = uthread_spawn(connectionEntry, 0);
+			check(tid >= 0, "spawning a connection failed");
+			socketOf[tid] = fd;
+		}
+		else
+		{
+			check(pthread_create(&connectionThreads[accepted], &pthreadAttributes,
+								 connectionThread, (void *) (long) fd) == 0,
+				  "creating a connection failed");
+		}
+		++accepted;
+	}
+}
+
+/**
+ * Entry point of the acceptor uthread.
+ */
+static void acceptorEntry()
+{
+	acceptConnections();
+	finishThread();
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the acceptor pthread.
+ */
+static void *acceptorThread(void *)
+{
+	acceptConnections();
+	return nullptr;
+}
+
+/**
+ * Entry point of the client uthreads.
+ */
+static void clientEntry()
+{
+	runClient(takeArgument(clientOf));
+	finishThread();
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the client pthreads.
+ */
+static void *clientThread(void *client)
+{
+	runClient((int) (long) client);
+	return nullptr;
+}
+
+/**
+ * Start listening on an ephemeral loopback port, and prepare for a run.
+ */
+static void startRun()
+{
+	listener = socket(AF_INET, SOCK_STREAM | (onUthreads ? SOCK_NONBLOCK : 0), 0);
+	checkSystem(listener >= 0, "socket failed");
+	serverAddress = {};
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t size = sizeof(serverAddress);
+	checkSystem(bind(listener, (sockaddr *) &serverAddress, size) == 0, "bind failed");
+	checkSystem(getsockname(listener, (sockaddr *) &serverAddress, &size) == 0,
+				"getsockname failed");
+	checkSystem(listen(listener, SOMAXCONN) == 0, "listen failed");
+	latencies.assign((size_t) numOfConnections * requestsPerConnection, 0);
+	clientsLeft = numOfConnections;
+}
+
+/**
+ * Run the clients and the server on uthreads.
+ * @return Seconds it took the clients to finish.
+ */
+static double runOnUthreads()
+{
+	onUthreads = true;
+	int quantum = QUANTUM_USECS;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	startRun();
+	std::fill(clientOf, clientOf + MAX_THREAD_NUM, NO_ARGUMENT);
+	std::fill(socketOf, socketOf + MAX_THREAD_NUM, NO_ARGUMENT);
+	doneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	checkSystem(doneFd >= 0, "eventfd failed");
+	threadsLeft = 2 * numOfConnections + 1;
+
+	Clock::time_point start = Clock::now();
+	check(uthread_spawn(acceptorEntry, 0) >= 0, "spawning the acceptor failed");
+	for (int client = 0; client < numOfConnections; ++client)
+	{
+		int tid = uthread_spawn(clientEntry, 0);
+		check(tid >= 0, "spawning a client failed");
+		clientOf[tid] = client;
+	}
+	// The main thread waits too, so the process sleeps whenever all the threads wait:
+	check(uthread_wait_fd(doneFd, POLLIN) == POLLIN, "waiting for the threads failed");
+
+	close(doneFd);
+	close(listener);
+	check(uthread_shutdown() == 0, "shutdown failed");
+	return std::chrono::duration<double>(clientsDone - start).count();
+}
+
+/**
+ * Run the clients and the server on a pthread per client and per connection.
+ * @return Seconds it took the clients to finish.
+ */
+static double runOnPthreads()
+{
+	onUthreads = false;
+	startRun();
+	connectionThreads.assign((size_t) numOfConnections, pthread_t());
+	std::vector<pthread_t> clients((size_t) numOfConnections);
+	pthread_attr_init(&pthreadAttributes);
+	pthread_attr_setstacksize(&pthreadAttributes, PTHREAD_STACK_SIZE);
+
+	Clock::time_point start = Clock::now();
+	pthread_t acceptor;
+	check(pthread_create(&acceptor, &pthreadAttributes, acceptorThread, nullptr) == 0,
+		  "creating the acceptor failed");
+	for (long client = 0; client < numOfConnections; ++client)
+	{
+		check(pthread_create(&clients[client], &pthreadAttributes, clientThread,
+							 (void *) client) == 0, "creating a client failed");
+	}
+	for (pthread_t &thread : clients)
+	{
+		pthread_join(thread, nullptr);
+	}
+
+	pthread_join(acceptor, nullptr);
+	for (pthread_t &thread : connectionThreads)
+	{
+		pthread_join(thread, nullptr);
+	}
+	pthread_attr_destroy(&pthreadAttributes);
+	close(listener);
+	return std::chrono::duration<double>(clientsDone - start).count();
+}
+
+/**
+ * Print the throughput and latency percentiles of a run.
+ */
+static void report(const char *name, double seconds)
+{
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [](double fraction) {
+		return latencies[(size_t) (fraction * (latencies.size() - 1))] / 1000.0;
+	};
+	printf("%-8s %9.0f requests/s, latency usecs: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, "
+		   "max %.1f\n", name, latencies.size() / seconds, percentile(0.5), percentile(0.9),
+		   percentile(0.99), percentile(0.999), percentile(1));
+	fflush(stdout);
+}
+
+/**
+ * Check that uthread_wait_fd rejects what it cannot wait for.
+ */
+static void checkWaitErrors()
+{
+	int quantum = QUANTUM_USECS;
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	check(uthread_wait_fd(-1, POLLIN) == -1, "waiting for a negative descriptor succeeded");
+	check(uthread_wait_fd(STDIN_FILENO, POLLPRI) == -1, "waiting for other events succeeded");
+	check(uthread_wait_fd(uthread_wakeup_fd(), POLLIN) == -1, "waiting for the doorbell succeeded");
+	char path[] = "/tmp/netBenchXXXXXX";
+	int file = mkstemp(path);
+	checkSystem(file >= 0, "mkstemp failed");
+	unlink(path);
+	check(uthread_wait_fd(file, POLLIN) == -1, "waiting for a regular file succeeded");
+	close(file);
+	check(uthread_shutdown() == 0, "shutdown failed");
+}
+
+int main(int argc, char *argv[])
+{
+	bool baseline = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--connections") && i + 1 < argc)
+		{
+			numOfConnections = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--requests") && i + 1 < argc)
+		{
+			requestsPerConnection = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--protocol") && i + 1 < argc && !strcmp(argv[i + 1], "echo"))
+		{
+			protocol = ECHO;
+			++i;
+		}
+		else if (!strcmp(argv[i], "--protocol") && i + 1 < argc && !strcmp(argv[i + 1], "http"))
+		{
+			protocol = HTTP;
+			++i;
+		}
+		else if (!strcmp(argv[i], "--baseline"))
+		{
+			baseline = true;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--connections N] [--requests N] [--protocol echo|http] "
+							"[--baseline]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	// A client and a connection thread per connection, plus the acceptor and the main thread:
+	if (numOfConnections <= 0 || requestsPerConnection <= 0 ||
+		2 * numOfConnections + 2 > MAX_THREAD_NUM)
+	{
+		fprintf(stderr, "connections must be in [1, %d], requests positive\n",
+				(MAX_THREAD_NUM - 2) / 2);
+		return EXIT_FAILURE;
+	}
+
+	checkWaitErrors();
+	printf("%s over loopback, %d connections x %d requests\n", protocol == ECHO ? "echo" : "http",
+		   numOfConnections, requestsPerConnection);
+	report("uthreads", runOnUthreads());
+	if (baseline)
+	{
+		report("pthreads", runOnPthreads());
+	}
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
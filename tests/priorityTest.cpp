@@ -0,0 +1,94 @@
+//
+// Test for the ready queues of the uthreads library when priorities change.
+//
+// With aging long enough that priorities order the ready threads strictly, a READY thread whose
+// priority changes must move to its new priority's queue: raised by uthread_change_priority, and
+// boosted while a more urgent thread waits for a mutex it holds. Quantums never expire, so the
+// threads run in a known order, which each appends its letter to.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#define NEVER_USECS 100000000 /* quantum that never expires during the test */
+#define STRICT_AGING 1000000 /* quanta per priority level, more than the test ever counts */
+
+static std::string order;
+static int mutex;
+
+/**
+ * Entry point of threads that only record that they ran.
+ */
+static void recordA()
+{
+	order += 'A';
+	uthread_terminate(uthread_get_tid());
+}
+
+static void recordB()
+{
+	order += 'B';
+	uthread_terminate(uthread_get_tid());
+}
+
+static void recordF()
+{
+	order += 'F';
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the urgent thread that waits for the mutex.
+ */
+static void urgent()
+{
+	check(uthread_mutex_lock(mutex) == 0, "lock failed");
+	order += 'H';
+	check(uthread_mutex_unlock(mutex) == 0, "unlock failed");
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Entry point of the thread that holds the mutex while it is queued behind F.
+ */
+static void holder()
+{
+	check(uthread_mutex_lock(mutex) == 0, "lock failed");
+	check(uthread_spawn(recordF, 1) > 0, "spawn failed");
+	uthread_yield();
+	order += 'L';
+	check(uthread_mutex_unlock(mutex) == 0, "unlock failed");
+	uthread_terminate(uthread_get_tid());
+}
+
+int main()
+{
+	int quantums[] = {NEVER_USECS, NEVER_USECS};
+	check(uthread_init(quantums, 2) == 0, "init failed");
+	check(uthread_set_aging(STRICT_AGING) == 0, "set_aging failed");
+	check(uthread_change_priority(0, 1) == 0, "change_priority of the main thread failed");
+
+	// B is queued behind A, until it is raised to priority 0:
+	check(uthread_spawn(recordA, 1) > 0, "spawn failed");
+	int b = uthread_spawn(recordB, 1);
+	check(b > 0 && uthread_change_priority(b, 0) == 0, "raising B failed");
+	uthread_yield();
+	check(order == "BA", "a raised thread stayed in the queue of its old priority");
+
+	// L locks the mutex and queues behind F. H then waits for the mutex, which boosts L to H's
+	// priority, so L runs before F and hands the mutex to H:
+	order.clear();
+	mutex = uthread_mutex_create();
+	check(mutex >= 0 && uthread_spawn(holder, 1) > 0, "spawn failed");
+	uthread_yield();
+	check(uthread_spawn(urgent, 0) > 0, "spawn failed");
+	uthread_yield();
+	check(order == "LHF", "a boosted thread stayed in the queue of its old priority");
+
+	check(uthread_shutdown() == 0, "shutdown failed");
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
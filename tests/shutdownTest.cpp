@@ -0,0 +1,63 @@
+//
+// Test for shutting the uthreads library down from a thread other than the main thread.
+//
+// A worker shuts the library down while the main thread waits for a file descriptor, and again
+// while it waits for a mutex the worker holds. The main thread must get back from the call it
+// was waiting in with -1, without touching the destroyed scheduler, and initialize the library
+// again each time.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+
+static int mutex;
+
+/**
+ * Entry point of the worker that shuts the library down right away.
+ */
+static void closer()
+{
+	uthread_shutdown();
+	check(false, "shutdown returned to a worker");
+}
+
+/**
+ * Entry point of the worker that shuts the library down while holding the mutex.
+ */
+static void holdingCloser()
+{
+	check(uthread_mutex_lock(mutex) == 0, "lock failed");
+	// Let the main thread start waiting for the mutex:
+	uthread_yield();
+	uthread_shutdown();
+	check(false, "shutdown returned to a worker");
+}
+
+int main()
+{
+	int quantum = 1000;
+	int pipeFds[2];
+	check(pipe(pipeFds) == 0, "pipe failed");
+
+	// Nothing is ever written to the pipe, so only the shutdown ends the wait:
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	check(uthread_spawn(closer, 0) > 0, "spawn failed");
+	check(uthread_wait_fd(pipeFds[0], POLLIN) == -1, "wait_fd did not fail after shutdown");
+
+	check(uthread_init(&quantum, 1) == 0, "init after a shutdown from a worker failed");
+	mutex = uthread_mutex_create();
+	check(mutex >= 0 && uthread_spawn(holdingCloser, 0) > 0, "creating the holder failed");
+	uthread_yield();
+	check(uthread_mutex_lock(mutex) == -1, "lock did not fail after shutdown");
+
+	check(uthread_init(&quantum, 1) == 0, "init after a shutdown from a worker failed");
+	check(uthread_get_tid() == 0 && uthread_shutdown() == 0, "shutdown from main failed");
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
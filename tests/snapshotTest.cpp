@@ -0,0 +1,218 @@
+//
+// Test for the snapshots of the uthreads library.
+//
+// Worker threads spawn, block, resume, yield and terminate each other under preemption, while a
+// monitor pthread in this process, and a monitor process through shared memory, read snapshots
+// as fast as they can. Every copy must be consistent: the count of threads matches the entries,
+// the running thread is ready, and counters never go back.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NUM_OF_WORKERS 16
+#define QUANTUMS 20000
+#define MIN_READS 1000
+
+static std::atomic<bool> done;
+static int workers[NUM_OF_WORKERS];
+
+/*
+ * What a monitor saw.
+ */
+struct Monitor
+{
+	long reads;
+	int lastTotal;
+	int maxThreads;
+	bool sawShutdown;
+};
+
+/**
+ * Read a snapshot and check that it is consistent, and consistent with the previous one.
+ */
+static void readAndCheck(const uthread_snapshot *source, Monitor &monitor)
+{
+	uthread_snapshot copy;
+	check(uthread_read_snapshot(source, &copy) == 0, "read_snapshot failed");
+	check(copy.sequence % 2 == 0, "copied a snapshot in the middle of an update");
+	check(copy.max_threads == MAX_THREAD_NUM, "wrong max_threads");
+	++monitor.reads;
+	if (copy.running_tid == -1)
+	{
+		// Not initialized yet, or shut down once the library was seen running:
+		check(copy.num_of_threads == 0, "threads left after shutdown");
+		monitor.sawShutdown = monitor.maxThreads > 0;
+		return;
+	}
+	int used = 0;
+	for (int tid = 0; tid < MAX_THREAD_NUM; ++tid)
+	{
+		const uthread_thread_snapshot &thread = copy.threads[tid];
+		if (thread.state != UTHREAD_UNUSED)
+		{
+			++used;
+			check(thread.quantums <= copy.total_quantums, "a thread ran more than all threads");
+		}
+	}
+	check(used == copy.num_of_threads, "the thread count does not match the entries");
+	check(copy.threads[copy.running_tid].state == UTHREAD_READY,
+		  "the running thread is not ready");
+	check(copy.threads[0].state == UTHREAD_READY, "the main thread is not ready");
+	check(copy.total_quantums >= monitor.lastTotal, "the total quantums went back");
+	monitor.lastTotal = copy.total_quantums;
+	monitor.maxThreads = std::max(monitor.maxThreads, copy.num_of_threads);
+}
+
+/**
+ * Entry point of the monitor pthread.
+ */
+static void *monitorThread(void *result)
+{
+	auto &monitor = *(Monitor *) result;
+	while (!done)
+	{
+		readAndCheck(nullptr, monitor);
+	}
+	return nullptr;
+}
+
+/**
+ * Body of the monitor process: read the shared snapshot until the library shuts down. Tells the
+ * parent through ready when it has the snapshot open, and again when it has seen the workers.
+ */
+static int monitorProcess(const char *name, int ready)
+{
+	// Do not spin forever if the parent dies:
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	const uthread_snapshot *shared = uthread_open_snapshot(name);
+	check(shared != nullptr, "open_snapshot failed");
+	char one = 1;
+	check(write(ready, &one, 1) == 1, "write failed");
+	Monitor monitor = {};
+	bool sawWorkers = false;
+	while (!monitor.sawShutdown || monitor.reads < MIN_READS)
+	{
+		readAndCheck(shared, monitor);
+		if (!sawWorkers && monitor.maxThreads > 1)
+		{
+			sawWorkers = true;
+			check(write(ready, &one, 1) == 1, "write failed");
+		}
+	}
+	check(uthread_close_snapshot(shared) == 0, "close_snapshot failed");
+	printf("monitor process: %ld consistent reads\n", monitor.reads);
+	fflush(stdout);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Entry point of the workers: churn through the library's operations.
+ */
+static void worker()
+{
+	int self = uthread_get_tid();
+	unsigned int random = (unsigned int) self;
+	while (true)
+	{
+		random = random * 1103515245 + 12345;
+		int other = workers[(random >> 16) % NUM_OF_WORKERS];
+		switch ((random >> 8) % 4)
+		{
+			case 0:
+				uthread_block(other == self ? workers[0] : other);
+				break;
+			case 1:
+				uthread_resume(other);
+				break;
+			case 2:
+				uthread_change_priority(other, (int) (random >> 4) % 2);
+				break;
+			default:
+				uthread_yield();
+		}
+	}
+}
+
+int main()
+{
+	std::string name = "/uthreads-snapshot-test-" + std::to_string(getpid());
+	uthread_snapshot before;
+	check(uthread_read_snapshot(nullptr, &before) == 0 && before.running_tid == -1,
+		  "a snapshot before init shows threads");
+	check(uthread_share_snapshot(name.c_str()) == 0, "share_snapshot failed");
+	check(uthread_share_snapshot("/uthreads-snapshot-test-again") == -1, "shared twice");
+	check(uthread_open_snapshot("/uthreads-snapshot-test-missing") == nullptr,
+		  "opened a missing snapshot");
+
+	// Start the monitor process before the library, and wait until it has the snapshot open:
+	int ready[2];
+	check(pipe(ready) == 0, "pipe failed");
+	pid_t child = fork();
+	check(child >= 0, "fork failed");
+	if (child == 0)
+	{
+		_exit(monitorProcess(name.c_str(), ready[1]));
+	}
+	char one;
+	check(read(ready[0], &one, 1) == 1, "the monitor process did not start");
+
+	// The monitor pthread must not get the library's timer signal:
+	sigset_t signals, old;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGVTALRM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old);
+	Monitor monitor = {};
+	pthread_t monitorPthread;
+	check(pthread_create(&monitorPthread, nullptr, monitorThread, &monitor) == 0,
+		  "pthread_create failed");
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	int quantums[] = {100, 200};
+	check(uthread_init(quantums, 2) == 0, "init failed");
+	for (int &tid : workers)
+	{
+		tid = uthread_spawn(worker, 0);
+		check(tid > 0, "spawn failed");
+	}
+	while (uthread_get_total_quantums() < QUANTUMS)
+	{
+		// Keep the workers from all blocking each other, and replace one now and then:
+		int total = uthread_get_total_quantums();
+		int &tid = workers[total % NUM_OF_WORKERS];
+		uthread_resume(tid);
+		if (total % 7 == 0)
+		{
+			uthread_terminate(tid);
+			tid = uthread_spawn(worker, 1);
+			check(tid > 0, "spawn failed");
+		}
+		uthread_yield();
+	}
+	// The monitor process may have been descheduled all along, so let it see the workers:
+	check(uthread_wait_fd(ready[0], POLLIN) == POLLIN && read(ready[0], &one, 1) == 1,
+		  "the monitor process never saw the workers");
+	check(uthread_shutdown() == 0, "shutdown failed");
+
+	done = true;
+	pthread_join(monitorPthread, nullptr);
+	int status;
+	check(waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+		  WEXITSTATUS(status) == EXIT_SUCCESS, "the monitor process failed");
+	check(uthread_share_snapshot(nullptr) == 0, "unlinking the snapshot failed");
+	check(monitor.reads >= MIN_READS && monitor.maxThreads > 1,
+		  "the monitor pthread did not see the workers");
+	printf("monitor pthread: %ld consistent reads\nok\n", monitor.reads);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,530 @@
+//
+// Stress and fairness harness for the uthreads library.
+//
+// Drives threads through random sequences of spawn, block, resume, terminate, change_priority
+// and yield calls, checks scheduler invariants along the way and reports the share of quantums
+// and CPU time each priority got.
+//
+// By default preemption points come from a virtual clock: the library is initialized with
+// quantums too long to ever expire, every operation advances the clock by a pseudo-random cost,
+// and a thread yields once it used up the virtual quantum of its priority. Given a seed, a run is
+// then fully reproducible. With --preempt the library's own SIGVTALRM timer is used instead.
+//
+// With --growable threads get small growable stacks, and also recurse to random depths. With
+// --adaptive (meant to go with --preempt) quantums adapt to the threads within bounds, and the
+// average runs the library reports must agree with the measured mean run. With
+// --aging N priorities order the ready threads, aged by N quantums per priority level; the
+// longest and mean number of quantums threads waited while ready are reported per priority.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_OF_PRIORITIES 3
+#define REAL_QUANTUM_NEVER 1000000000 /* quantum that never expires during a run (usecs) */
+#define MAX_OP_COST 50 /* maximal virtual cost of an operation (usecs) */
+#define DEFAULT_OPS 100000
+#define DEFAULT_SEED 1
+#define GROWABLE_INITIAL_STACK 4096 /* bytes */
+#define GROWABLE_MAX_STACK (1 << 20) /* bytes */
+#define ADAPTIVE_MIN_QUANTUM 50 /* usecs */
+#define ADAPTIVE_MAX_QUANTUM 5000 /* usecs */
+#define ADAPTIVE_SETTLED_RUNS 8 /* quantums after which a thread's average run reflects its runs */
+#define ADAPTIVE_RUN_TOLERANCE 4 /* factor average runs may be off from the measured mean run */
+#define RECURSION_FRAME 1024 /* bytes */
+#define MAX_RECURSION_DEPTH 256 /* frames */
+
+/*
+ * Virtual quantum of each priority, in microseconds.
+ */
+static const int virtualQuantums[NUM_OF_PRIORITIES] = {100, 200, 400};
+
+/*
+ * What the harness expects the library's state to be.
+ */
+struct Model
+{
+	bool alive[MAX_THREAD_NUM];
+	bool blocked[MAX_THREAD_NUM];
+	int priority[MAX_THREAD_NUM];
+	int seenQuantums[MAX_THREAD_NUM];
+	int readySince[MAX_THREAD_NUM];
+	int numOfThreads;
+};
+
+/*
+ * Statistics of a single run.
+ */
+struct Stats
+{
+	long long ops;
+	long long spawns;
+	long long observedQuantums;
+	long long quantumsPerPriority[NUM_OF_PRIORITIES];
+	long long cpuPerPriority[NUM_OF_PRIORITIES];
+	long long maxWaitPerPriority[NUM_OF_PRIORITIES];
+	long long waitPerPriority[NUM_OF_PRIORITIES];
+	long long waitsPerPriority[NUM_OF_PRIORITIES];
+	long long averageRunSum;
+	long long averageRunSamples;
+	unsigned long long traceHash;
+};
+
+static Model model;
+static Stats stats;
+static unsigned long long rngState;
+static long long targetOps;
+static bool preemptive = false;
+static bool growable = false;
+static bool adaptive = false;
+static int aging = -1;
+static long long virtualNow;
+static long long sliceEnd;
+
+/**
+ * Print the operation and thread a run is at, after the message of a failed check.
+ */
+static void describeOp()
+{
+	printf(" (op %lld, thread %d)", stats.ops, uthread_get_tid());
+}
+
+/**
+ * Get the cpu time of the kernel thread running all the threads, in microseconds.
+ */
+static long long cpuUsecs()
+{
+	timespec now{};
+	check(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0, "clock_gettime failed");
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Next pseudo-random number (xorshift64*), so that runs depend only on the seed.
+ */
+static unsigned long long nextRandom()
+{
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+/**
+ * Pseudo-random number in [0, bound).
+ */
+static int randomBelow(int bound)
+{
+	return (int) (nextRandom() % (unsigned long long) bound);
+}
+
+/**
+ * Mix an event into the trace hash (FNV-1a).
+ */
+static void trace(int a, int b, int c)
+{
+	const int values[] = {a, b, c};
+	for (int value : values)
+	{
+		stats.traceHash ^= (unsigned int) value;
+		stats.traceHash *= 1099511628211ULL;
+	}
+}
+
+/**
+ * Pick a random live thread, optionally excluding the main thread.
+ * @return Its ID, or -1 if there is none.
+ */
+static int randomLiveThread(bool includeMain)
+{
+	int first = includeMain ? 0 : 1;
+	int start = first + randomBelow(MAX_THREAD_NUM - first);
+	for (int i = 0; i < MAX_THREAD_NUM - first; ++i)
+	{
+		int tid = first + (start - first + i) % (MAX_THREAD_NUM - first);
+		if (model.alive[tid])
+		{
+			return tid;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Account for the quantums the running thread started since it was last seen.
+ */
+static void observeQuantums(int self)
+{
+	int quantums = uthread_get_quantums(self);
+	check(quantums >= model.seenQuantums[self], "quantum count of a thread decreased");
+	if (quantums > model.seenQuantums[self])
+	{
+		// Count the quantums other threads started since we were last running or were made ready:
+		int priority = model.priority[self];
+		long long wait = uthread_get_total_quantums() - model.readySince[self] - 1;
+		stats.maxWaitPerPriority[priority] = std::max(stats.maxWaitPerPriority[priority], wait);
+		stats.waitPerPriority[priority] += wait;
+		++stats.waitsPerPriority[priority];
+		stats.observedQuantums += quantums - model.seenQuantums[self];
+		stats.quantumsPerPriority[model.priority[self]] += quantums - model.seenQuantums[self];
+		model.seenQuantums[self] = quantums;
+		if (adaptive && quantums >= ADAPTIVE_SETTLED_RUNS)
+		{
+			// Sample the library's average of the runs this thread finished:
+			uthread_stats threadStats;
+			check(uthread_get_stats(self, &threadStats) == 0, "get_stats failed");
+			stats.averageRunSum += threadStats.average_run_usecs;
+			++stats.averageRunSamples;
+		}
+		sliceEnd = virtualNow + virtualQuantums[model.priority[self]];
+	}
+}
+
+/**
+ * Use about depth * RECURSION_FRAME bytes of stack.
+ * @return depth + 1, read back from both ends of every frame.
+ */
+static int recurse(int depth)
+{
+	volatile char frame[RECURSION_FRAME];
+	frame[0] = 1;
+	frame[RECURSION_FRAME - 1] = 1;
+	if (depth == 0)
+	{
+		return frame[0];
+	}
+	return recurse(depth - 1) + frame[RECURSION_FRAME - 1];
+}
+
+static void worker();
+
+/**
+ * Preform one random operation on behalf of the running thread.
+ */
+static void step()
+{
+	int self = uthread_get_tid();
+	if (!preemptive)
+	{
+		// Under real preemption the model may lag behind the library for an operation.
+		check(model.alive[self], "a terminated thread is running");
+		check(!model.blocked[self], "a blocked thread is running");
+	}
+	observeQuantums(self);
+
+	if (stats.ops >= targetOps)
+	{
+		// The run is over, let the main thread check the results.
+		uthread_yield();
+		return;
+	}
+	++stats.ops;
+
+	int cost = 1 + randomBelow(MAX_OP_COST);
+	virtualNow += cost;
+	stats.cpuPerPriority[model.priority[self]] += cost;
+
+	int op = randomBelow(100);
+	int target = -1;
+	int result = 0;
+	if (op < 12)
+	{
+		// Spawn, keeping a free slot so that spawning never fails:
+		if (model.numOfThreads < MAX_THREAD_NUM - 1)
+		{
+			int priority = randomBelow(NUM_OF_PRIORITIES);
+			target = uthread_spawn(worker, priority);
+			check(target > 0 && !model.alive[target], "spawn returned a bad ID");
+			model.alive[target] = true;
+			model.blocked[target] = false;
+			model.priority[target] = priority;
+			model.seenQuantums[target] = 0;
+			model.readySince[target] = uthread_get_total_quantums();
+			++model.numOfThreads;
+			++stats.spawns;
+		}
+	}
+	else if (op < 22)
+	{
+		// Block a thread, possibly ourselves:
+		target = randomLiveThread(false);
+		if (target != -1)
+		{
+			model.blocked[target] = true;
+			result = uthread_block(target);
+			check(result == 0, "block failed");
+			check(!model.blocked[self], "a thread returned from block without being resumed");
+		}
+	}
+	else if (op < 34)
+	{
+		// Resume a thread:
+		target = randomLiveThread(true);
+		if (model.blocked[target])
+		{
+			model.readySince[target] = uthread_get_total_quantums();
+		}
+		model.blocked[target] = false;
+		result = uthread_resume(target);
+		check(result == 0, "resume failed");
+	}
+	else if (op < 40)
+	{
+		// Terminate a thread, possibly ourselves:
+		target = randomLiveThread(false);
+		if (target != -1)
+		{
+			model.alive[target] = false;
+			--model.numOfThreads;
+			trace(self, op, target);
+			result = uthread_terminate(target);
+			check(result == 0 && target != self, "terminate failed");
+		}
+	}
+	else if (op < 48)
+	{
+		// Change the priority of a thread:
+		target = randomLiveThread(true);
+		int priority = randomBelow(NUM_OF_PRIORITIES);
+		result = uthread_change_priority(target, priority);
+		check(result == 0, "change_priority failed");
+		model.priority[target] = priority;
+	}
+	else if (op < 50)
+	{
+		target = self;
+		result = uthread_yield();
+	}
+	else if (op < 53 && growable)
+	{
+		// Recurse deep enough to grow the stack, possibly getting preempted on the way:
+		target = randomBelow(MAX_RECURSION_DEPTH);
+		check(recurse(target) == target + 1, "recursion got a wrong result");
+	}
+	trace(self, op, result == 0 ? target : result);
+
+	// We may have been switched out and back in by the operation:
+	observeQuantums(self);
+	model.readySince[self] = uthread_get_total_quantums();
+	if (!preemptive && virtualNow >= sliceEnd)
+	{
+		// The virtual quantum is over:
+		uthread_yield();
+		sliceEnd = virtualNow + virtualQuantums[model.priority[self]];
+	}
+}
+
+/**
+ * Entry point of all the spawned threads.
+ */
+static void worker()
+{
+	while (true)
+	{
+		step();
+	}
+}
+
+/**
+ * Check that the library's counters agree with the model, from the main thread.
+ */
+static void checkInvariants()
+{
+	observeQuantums(0);
+	int unused = -1;
+	for (int tid = 0; tid < MAX_THREAD_NUM; ++tid)
+	{
+		int quantums = uthread_get_quantums(tid);
+		check(model.alive[tid] == (quantums >= 0), "thread existence differs from the model");
+		if (!model.alive[tid])
+		{
+			unused = tid;
+		}
+		else
+		{
+			uthread_stats threadStats;
+			check(uthread_get_stats(tid, &threadStats) == 0, "get_stats failed");
+			check(threadStats.quantums == quantums, "statistics differ from get_quantums");
+			check(!adaptive || (threadStats.quantum_usecs >= ADAPTIVE_MIN_QUANTUM &&
+								threadStats.quantum_usecs <= ADAPTIVE_MAX_QUANTUM),
+				  "adaptive quantum out of bounds");
+			if (!preemptive)
+			{
+				// A thread that was switched to has run, so it saw its own quantum.
+				check(quantums == model.seenQuantums[tid], "thread ran without being seen");
+			}
+		}
+	}
+	if (preemptive)
+	{
+		check(stats.observedQuantums <= uthread_get_total_quantums(), "more quantums seen than started");
+	}
+	else
+	{
+		check(stats.observedQuantums == uthread_get_total_quantums(),
+			  "total quantums differ from started quantums");
+	}
+
+	// Errors must be reported, not acted on:
+	check(uthread_block(0) == -1, "blocking the main thread succeeded");
+	if (unused != -1)
+	{
+		check(uthread_resume(unused) == -1, "resuming a missing thread succeeded");
+		check(uthread_terminate(unused) == -1, "terminating a missing thread succeeded");
+	}
+}
+
+/**
+ * Run the harness once.
+ * @return The trace hash of the run.
+ */
+static unsigned long long run(unsigned long long seed, long long ops)
+{
+	memset(&model, 0, sizeof(model));
+	memset(&stats, 0, sizeof(stats));
+	rngState = seed * 0x9E3779B97F4A7C15ULL + 1;
+	targetOps = ops;
+	virtualNow = 0;
+	sliceEnd = 0;
+	model.alive[0] = true;
+	model.numOfThreads = 1;
+
+	int quantums[NUM_OF_PRIORITIES];
+	for (int i = 0; i < NUM_OF_PRIORITIES; ++i)
+	{
+		quantums[i] = preemptive ? virtualQuantums[i] : REAL_QUANTUM_NEVER;
+	}
+	check(uthread_init(quantums, NUM_OF_PRIORITIES) == 0, "init failed");
+	if (growable)
+	{
+		check(uthread_set_growable_stacks(GROWABLE_INITIAL_STACK, GROWABLE_MAX_STACK) == 0,
+			  "set_growable_stacks failed");
+	}
+	if (aging >= 0)
+	{
+		check(uthread_set_aging(aging) == 0, "set_aging failed");
+	}
+	if (adaptive)
+	{
+		check(uthread_set_adaptive_quantum(ADAPTIVE_MIN_QUANTUM, ADAPTIVE_MAX_QUANTUM) == 0,
+			  "set_adaptive_quantum failed");
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	long long startCpu = cpuUsecs();
+	while (stats.ops < targetOps)
+	{
+		step();
+	}
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	checkInvariants();
+	if (adaptive && stats.averageRunSamples > 0)
+	{
+		// The sampled averages must be about the mean run, all the cpu time over all the runs:
+		double meanRun = (double) (cpuUsecs() - startCpu) / uthread_get_total_quantums();
+		double meanAverage = (double) stats.averageRunSum / (double) stats.averageRunSamples;
+		check(meanAverage >= meanRun / ADAPTIVE_RUN_TOLERANCE &&
+			  meanAverage <= meanRun * ADAPTIVE_RUN_TOLERANCE, "average runs are implausible");
+	}
+
+	printf("seed %llu: %lld ops, %lld spawns, %lld quantums, %.0f ns/op, trace %016llx\n", seed,
+		   stats.ops, stats.spawns, stats.observedQuantums, elapsed * 1e9 / (double) stats.ops,
+		   stats.traceHash);
+	long long totalCpu = 0;
+	for (long long cpu : stats.cpuPerPriority)
+	{
+		totalCpu += cpu;
+	}
+	for (int priority = 0; priority < NUM_OF_PRIORITIES; ++priority)
+	{
+		printf("  priority %d: %5.1f%% of quantums, %5.1f%% of cpu, waited %lld quantums at most, "
+			   "%.1f on average\n", priority,
+			   100.0 * (double) stats.quantumsPerPriority[priority] /
+			   (double) stats.observedQuantums,
+			   100.0 * (double) stats.cpuPerPriority[priority] / (double) totalCpu,
+			   stats.maxWaitPerPriority[priority],
+			   (double) stats.waitPerPriority[priority] /
+			   (double) std::max(1LL, stats.waitsPerPriority[priority]));
+	}
+	fflush(stdout);
+
+	check(uthread_shutdown() == 0, "shutdown failed");
+	return stats.traceHash;
+}
+
+int main(int argc, char *argv[])
+{
+	checkContext = describeOp;
+	unsigned long long seed = DEFAULT_SEED;
+	long long ops = DEFAULT_OPS;
+	int runs = 1;
+	bool checkReproducible = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+		{
+			seed = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (!strcmp(argv[i], "--ops") && i + 1 < argc)
+		{
+			ops = strtoll(argv[++i], nullptr, 10);
+		}
+		else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+		{
+			runs = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--preempt"))
+		{
+			preemptive = true;
+		}
+		else if (!strcmp(argv[i], "--growable"))
+		{
+			growable = true;
+		}
+		else if (!strcmp(argv[i], "--aging") && i + 1 < argc)
+		{
+			aging = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--adaptive"))
+		{
+			adaptive = true;
+		}
+		else if (!strcmp(argv[i], "--check-reproducible"))
+		{
+			checkReproducible = true;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--seed N] [--ops N] [--runs N] [--preempt] "
+							"[--growable] [--adaptive] [--aging N] [--check-reproducible]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// The library reports the errors the harness provokes on stderr; keep the output readable.
+	int devNull = open("/dev/null", O_WRONLY);
+	if (devNull != -1)
+	{
+		dup2(devNull, STDERR_FILENO);
+		close(devNull);
+	}
+
+	for (int i = 0; i < runs; ++i)
+	{
+		unsigned long long hash = run(seed + i, ops);
+		if (checkReproducible && !preemptive)
+		{
+			check(run(seed + i, ops) == hash, "same seed produced a different trace");
+		}
+	}
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+//
+// Helpers shared by the tests of the uthreads library.
+//
+
+#ifndef THREADS_TESTUTILS_H
+#define THREADS_TESTUTILS_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Prints where a test is, after the message of a failed check, or nullptr.
+ */
+static void (*checkContext)() = nullptr;
+
+/**
+ * Abort the test if a condition does not hold.
+ */
+static inline void check(bool condition, const char *what)
+{
+	if (!condition)
+	{
+		printf("FAILED: %s", what);
+		if (checkContext != nullptr)
+		{
+			checkContext();
+		}
+		printf("\n");
+		fflush(stdout);
+		abort();
+	}
+}
+
+/**
+ * Abort the test if a condition on the result of a system call does not hold, with the error
+ * the call set errno to.
+ */
+static inline void checkSystem(bool condition, const char *what)
+{
+	if (!condition)
+	{
+		printf("FAILED: %s (%s)\n", what, strerror(errno));
+		fflush(stdout);
+		abort();
+	}
+}
+
+#endif //THREADS_TESTUTILS_H
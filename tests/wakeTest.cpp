@@ -0,0 +1,242 @@
+//
+// Test for posting resumes to the uthreads library from outside of it.
+//
+// Sleeper threads count their wakeups and block themselves again. Waker pthreads resume them
+// with uthread_post_resume and wait to see each wakeup, and a SIGALRM handler keeps waking
+// another sleeper. The main thread waits for the doorbell and yields to apply the requests.
+// Then the main thread waits for a mutex whose holder is blocked until a pthread posts its resume.
+// Before all that, a child process makes the main thread wait for the mutex with no other kernel
+// thread to post, which must be reported as a deadlock.
+//
+
+#include "uthreads.h"
+#include "testUtils.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_OF_SLEEPERS 8
+#define NUM_OF_WAKERS 4
+#define ROUNDS 2000
+#define REPOST_USECS 200 /* how long a waker waits for a wakeup before posting again */
+#define TIMEOUT_SECS 30
+#define ALARM_USECS 1000
+#define HOLDER_WAKE_USECS 100000
+
+static int sleepers[NUM_OF_SLEEPERS];
+static std::atomic<int> wakeups[NUM_OF_SLEEPERS];
+static std::atomic<int> alarmWakeups;
+static std::atomic<int> wakersDone;
+static int alarmSleeper;
+static int mutex;
+static int holderTid;
+
+/**
+ * Entry point of the sleepers woken by the wakers.
+ */
+static void sleeper()
+{
+	int self = uthread_get_tid();
+	int index = 0;
+	while (sleepers[index] != self)
+	{
+		++index;
+	}
+	while (true)
+	{
+		++wakeups[index];
+		uthread_block(self);
+	}
+}
+
+/**
+ * Entry point of the sleeper woken by the alarm.
+ */
+static void alarmSleeperEntry()
+{
+	while (true)
+	{
+		++alarmWakeups;
+		uthread_block(uthread_get_tid());
+	}
+}
+
+/**
+ * Entry point of the thread that blocks itself while holding the mutex, and releases it once
+ * resumed.
+ */
+static void holder()
+{
+	check(uthread_mutex_lock(mutex) == 0, "lock failed");
+	uthread_block(uthread_get_tid());
+	check(uthread_mutex_unlock(mutex) == 0, "unlock failed");
+	uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Create the mutex and let the holder lock it and block.
+ */
+static void holdMutex()
+{
+	mutex = uthread_mutex_create();
+	holderTid = uthread_spawn(holder, 0);
+	check(mutex >= 0 && holderTid > 0, "creating the holder failed");
+	uthread_yield();
+}
+
+/**
+ * Entry point of the pthread that resumes the holder, after the main thread started waiting.
+ */
+static void *holderWaker(void *)
+{
+	usleep(HOLDER_WAKE_USECS);
+	check(uthread_post_resume(holderTid) == 0, "post_resume failed");
+	return nullptr;
+}
+
+/**
+ * Post a resume of the alarm sleeper, from a signal handler.
+ */
+static void alarmHandler(int)
+{
+	uthread_post_resume(alarmSleeper);
+}
+
+/**
+ * Entry point of the waker pthreads: wake each of our sleepers ROUNDS times, waiting to see every
+ * wakeup. A request that came while the sleeper was not blocked yet is dropped, so post again
+ * if the wakeup takes long.
+ */
+static void *waker(void *arg)
+{
+	long first = (long) arg;
+	time_t deadline = time(nullptr) + TIMEOUT_SECS;
+	for (int round = 0; round < ROUNDS; ++round)
+	{
+		for (long index = first; index < NUM_OF_SLEEPERS; index += NUM_OF_WAKERS)
+		{
+			int seen = wakeups[index];
+			while (wakeups[index] == seen)
+			{
+				check(uthread_post_resume(sleepers[index]) == 0, "post_resume failed");
+				usleep(REPOST_USECS);
+				check(time(nullptr) < deadline, "a sleeper was not woken in time");
+			}
+		}
+	}
+	++wakersDone;
+	return nullptr;
+}
+
+int main()
+{
+	// With no other kernel thread to post a resume of the holder, nothing can release the mutex:
+	int errors[2];
+	check(pipe(errors) == 0, "pipe failed");
+	fflush(stdout);
+	pid_t child = fork();
+	check(child >= 0, "fork failed");
+	int quantum = 1000;
+	if (child == 0)
+	{
+		dup2(errors[1], STDERR_FILENO);
+		check(uthread_init(&quantum, 1) == 0, "init failed");
+		holdMutex();
+		uthread_mutex_lock(mutex);
+		_exit(EXIT_SUCCESS);
+	}
+	close(errors[1]);
+	std::string report;
+	char buffer[256];
+	ssize_t length;
+	while ((length = read(errors[0], buffer, sizeof(buffer))) > 0)
+	{
+		report.append(buffer, (size_t) length);
+	}
+	close(errors[0]);
+	check(report.find("Deadlock") != std::string::npos, "a deadlock was not reported");
+	int status;
+	check(waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+		  WEXITSTATUS(status) == EXIT_FAILURE, "the deadlock did not exit the program");
+
+	check(uthread_init(&quantum, 1) == 0, "init failed");
+	check(uthread_post_resume(-1) == -1 && uthread_post_resume(MAX_THREAD_NUM) == -1,
+		  "posting a bad ID succeeded");
+	for (int &tid : sleepers)
+	{
+		tid = uthread_spawn(sleeper, 0);
+	}
+	alarmSleeper = uthread_spawn(alarmSleeperEntry, 0);
+	// Let every sleeper count its first run and block:
+	uthread_yield();
+	for (std::atomic<int> &count : wakeups)
+	{
+		check(count == 1, "a sleeper did not run first");
+	}
+
+	// The wakers must not get the library's timer signal, nor the alarm:
+	sigset_t signals, old;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGVTALRM);
+	sigaddset(&signals, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old);
+	pthread_t wakers[NUM_OF_WAKERS];
+	for (long i = 0; i < NUM_OF_WAKERS; ++i)
+	{
+		check(pthread_create(&wakers[i], nullptr, waker, (void *) i) == 0, "pthread_create failed");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	struct sigaction sa = {};
+	sa.sa_handler = alarmHandler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, nullptr);
+	itimerval alarmTimer = {{0, ALARM_USECS}, {0, ALARM_USECS}};
+	setitimer(ITIMER_REAL, &alarmTimer, nullptr);
+
+	// Sleep until requests are posted, then let them in:
+	pollfd doorbell = {uthread_wakeup_fd(), POLLIN, 0};
+	while (wakersDone < NUM_OF_WAKERS)
+	{
+		poll(&doorbell, 1, 1);
+		uthread_yield();
+	}
+
+	itimerval stop = {};
+	setitimer(ITIMER_REAL, &stop, nullptr);
+	for (pthread_t &thread : wakers)
+	{
+		pthread_join(thread, nullptr);
+	}
+	for (int index = 0; index < NUM_OF_SLEEPERS; ++index)
+	{
+		// Each sleeper counted its first run, then at least one wakeup per round (a request
+		// posted again while the first one was being applied may wake it once more):
+		check(wakeups[index] >= ROUNDS + 1, "a sleeper missed a round");
+	}
+	check(alarmWakeups > 1, "the alarm sleeper was never woken");
+
+	// No thread can run while the main thread waits for the mutex, so the library sleeps until
+	// the pthread posts the holder's resume:
+	holdMutex();
+	pthread_t wakerOfHolder;
+	pthread_sigmask(SIG_BLOCK, &signals, &old);
+	check(pthread_create(&wakerOfHolder, nullptr, holderWaker, nullptr) == 0,
+		  "pthread_create failed");
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	check(uthread_mutex_lock(mutex) == 0 && uthread_mutex_unlock(mutex) == 0,
+		  "the mutex was not handed to the main thread");
+	pthread_join(wakerOfHolder, nullptr);
+	printf("%d rounds of wakeups from pthreads, %d from the alarm\nok\n", ROUNDS,
+		   alarmWakeups.load() - 1);
+	check(uthread_shutdown() == 0, "shutdown failed");
+	return EXIT_SUCCESS;
+}
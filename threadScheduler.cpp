@@ -4,6 +4,9 @@
 
 #include "threadScheduler.h"
 #include <iostream>
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#endif
 
 #define MAX_MILISECONDS 999999
 #define MAIN_THREAD_ID 0
@@ -12,6 +15,21 @@
 #define MAIN_THREAD_PRIORITY 0
 #define INITIAL_QUANTUMS 1
 #define INITIAL_NUM_OF_THREADS 1
+#define NO_THREAD -1
+#define NO_MUTEX -1
+#define NO_FD -1
+#define NOT_QUEUED -1
+#define USECS_PER_SEC 1000000
+#define PER_MILLE 1000
+#define ADAPTATION_WEIGHT 4 /* moving averages move by 1/ADAPTATION_WEIGHT of each new sample */
+
+#ifdef UTHREADS_COOPERATIVE
+/* Threads only switch from within the library, and never in a signal handler, so the signal mask
+   is the same everywhere and need not be saved and restored on every switch. */
+#define SAVE_SIGNAL_MASK 0
+#else
+#define SAVE_SIGNAL_MASK 1
+#endif
 
 
 #ifdef __x86_64__
@@ -23,6 +41,14 @@ typedef unsigned long address_t;
 
 #define JB_PC 7
 
+#define REG_SP REG_RSP
+
+#define REG_PC REG_RIP
+
+#define REG_FP REG_RBP
+
+#define JB_BP 1
+
 /* A translation is required when using an address of a variable.
    Use this as a black box in your code. */
 address_t translate_address(address_t addr)
@@ -35,12 +61,38 @@ address_t translate_address(address_t addr)
     return ret;
 }
 
+/* Undo translate_address, to read an address saved in an environment. */
+address_t untranslate_address(address_t addr)
+{
+    address_t ret;
+    asm volatile("ror    $0x11,%0\n"
+                 "xor    %%fs:0x30,%0\n"
+    : "=g" (ret)
+    : "0" (addr));
+    return ret;
+}
+
+/* The saved frame pointer is translated like the stack pointer. */
+address_t translate_frame_pointer(address_t addr)
+{
+    return translate_address(addr);
+}
+
+address_t untranslate_frame_pointer(address_t addr)
+{
+    return untranslate_address(addr);
+}
+
 #else
 /* code for 32 bit Intel arch */
 
 typedef unsigned int address_t;
 #define JB_SP 4
 #define JB_PC 5
+#define REG_SP REG_ESP
+#define REG_PC REG_EIP
+#define REG_FP REG_EBP
+#define JB_BP 3
 
 /* A translation is required when using an address of a variable.
    Use this as a black box in your code. */
@@ -53,396 +105,2415 @@ address_t translate_address(address_t addr)
                  : "0" (addr));
     return ret;
 }
-#endif
 
-Thread::Thread(int id, int priority, EntryPoint_t entry, bool mainThread)
-        : id(id), totalQuantum(mainThread), priority(priority), state(READY), stack(nullptr)
+/* Undo translate_address, to read an address saved in an environment. */
+address_t untranslate_address(address_t addr)
 {
-    sigsetjmp(environment, 1);
-    if (!mainThread)
-    {
-    	// Creating a new thread, set environment and allcoate a stack.
-        stack = std::unique_ptr<char[]>(new char[STACK_SIZE]);
-        address_t sp = (address_t) stack.get() + STACK_SIZE - sizeof(address_t);
-        auto pc = (address_t) entry;
-        (environment->__jmpbuf)[JB_SP] = translate_address(sp);
-        (environment->__jmpbuf)[JB_PC] = translate_address(pc);
-        if (sigemptyset(&environment->__saved_mask))
-        {
-            std::cerr << SYS_ERROR_SIGEMPTYSET;
-            exit(EXIT_FAILURE);
-        }
-    }
+    address_t ret;
+    asm volatile("ror    $0x9,%0\n"
+        "xor    %%gs:0x18,%0\n"
+                 : "=g" (ret)
+                 : "0" (addr));
+    return ret;
 }
 
-sigjmp_buf &Thread::getEnvironment()
+/* The saved frame pointer is kept as is. */
+address_t translate_frame_pointer(address_t addr)
 {
-    return environment;
+    return addr;
 }
 
-int Thread::getId() const
+address_t untranslate_frame_pointer(address_t addr)
 {
-    return id;
+    return addr;
 }
+#endif
 
-int Thread::getPriority() const
+/**
+ * Build a one-shot timer that expires after usecs microseconds.
+ */
+static itimerval usecsToTimer(long long usecs)
 {
-    return priority;
+    itimerval timer{};
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 0;
+    __time_t seconds = 0;
+    while (usecs > MAX_MILISECONDS)
+    {
+        // Number of milliseconds is longer than a second.
+        ++seconds;
+        usecs -= MAX_MILISECONDS;
+    }
+    timer.it_value.tv_sec = seconds;
+    timer.it_value.tv_usec = (__suseconds_t) usecs;
+    return timer;
 }
 
-void Thread::setPriority(int _priority)
+/**
+ * Get the length of a time value in microseconds.
+ */
+static long long timeToUsecs(const timeval &time)
 {
-    this->priority = _priority;
+    return (long long) time.tv_sec * USECS_PER_SEC + time.tv_usec;
 }
 
-Thread::states Thread::getState() const
+/**
+ * Print one frame of a backtrace: its address and, if it can be found, the function it is in, or
+ * else the object it is in and its offset there (for addr2line).
+ * @param fd File descriptor to write to.
+ * @param depth Number of the frame.
+ * @param pc Return address of the frame.
+ */
+static void dumpFrame(int fd, int depth, address_t pc)
 {
-    return state;
+    // A return address points after the call, which may be the start of the next function:
+    Dl_info info{};
+    if (!dladdr((void *) (pc - 1), &info))
+    {
+        dprintf(fd, "    #%d 0x%lx\n", depth, (unsigned long) pc);
+        return;
+    }
+    if (info.dli_sname == nullptr)
+    {
+        dprintf(fd, "    #%d 0x%lx in %s+0x%lx\n", depth, (unsigned long) pc, info.dli_fname,
+                (unsigned long) (pc - (address_t) info.dli_fbase));
+        return;
+    }
+    int status = 0;
+    char *name = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    dprintf(fd, "    #%d 0x%lx in %s+0x%lx\n", depth, (unsigned long) pc,
+            status == 0 ? name : info.dli_sname, (unsigned long) (pc - (address_t) info.dli_saddr));
+    free(name);
 }
 
-void Thread::setState(states _state)
+/*
+ * A line of a dump written in a signal handler, put together without stdio.
+ */
+struct RawLine
 {
-    Thread::state = _state;
-}
+    char text[RAW_DUMP_LINE_SIZE];
+    size_t length;
+};
 
-void Thread::incrementTotalQuantum()
+/**
+ * Append text to a line, as much of it as fits.
+ */
+static void rawAppend(RawLine &line, const char *text)
 {
-    ++totalQuantum;
+    while (*text != '\0' && line.length < RAW_DUMP_LINE_SIZE)
+    {
+        line.text[line.length++] = *text++;
+    }
 }
 
-int Thread::getTotalQuantum() const
+/**
+ * Append the digits of a number in base 10 or 16 to a line, as many of them as fit.
+ */
+static void rawAppendDigits(RawLine &line, unsigned long number, unsigned long base)
 {
-    return totalQuantum;
+    char digits[3 * sizeof(number)];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = "0123456789abcdef"[number % base];
+        number /= base;
+    } while (number != 0);
+    while (count > 0 && line.length < RAW_DUMP_LINE_SIZE)
+    {
+        line.text[line.length++] = digits[--count];
+    }
 }
 
-Dispatcher::Dispatcher() : totalQuantums(INITIAL_QUANTUMS)
+/**
+ * Append a number in decimal to a line.
+ */
+static void rawAppendNumber(RawLine &line, long number)
 {
+    if (number < 0)
+    {
+        rawAppend(line, "-");
+    }
+    rawAppendDigits(line, number < 0 ? 0 - (unsigned long) number : (unsigned long) number, 10);
 }
 
-void Dispatcher::switchToThread(std::shared_ptr<Thread> &&currentThread,
-                                const std::shared_ptr<Thread> &targetThread)
+/**
+ * Write a line with write(2) only, and empty it.
+ */
+static void rawWrite(int fd, RawLine &line)
 {
-	// Increment the quantum count:
-    ++totalQuantums;
-    targetThread->incrementTotalQuantum();
-
-    // Save current state
-    int ret_val = sigsetjmp(currentThread->getEnvironment(), 1);
-    if (ret_val == 1)
+    const char *next = line.text;
+    size_t left = line.length;
+    while (left > 0)
     {
-		return;
-	}
-    // Before jumping, release the pointer for the old thread.
-	currentThread.reset();
-
-    // Preform context switch.
-	siglongjmp(targetThread->getEnvironment(), 1);
+        ssize_t written = write(fd, next, left);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            break;
+        }
+        next += written;
+        left -= (size_t) written;
+    }
+    line.length = 0;
 }
 
-int Dispatcher::getTotalQuantums() const
+/**
+ * Print one frame of a backtrace by its address alone, in a signal handler.
+ * @param fd File descriptor to write to.
+ * @param depth Number of the frame.
+ * @param pc Return address of the frame.
+ */
+static void dumpRawFrame(int fd, int depth, address_t pc)
 {
-    return totalQuantums;
+    RawLine line{};
+    rawAppend(line, "    #");
+    rawAppendNumber(line, depth);
+    rawAppend(line, " 0x");
+    rawAppendDigits(line, (unsigned long) pc, 16);
+    rawAppend(line, "\n");
+    rawWrite(fd, line);
 }
 
-Scheduler::Scheduler(const std::map<int, int> &pQuantums) : numOfThreads(INITIAL_NUM_OF_THREADS)
+/**
+ * Print a backtrace by following frame pointers, starting from a return address and the frame
+ * pointer of the frame it returns to.
+ * @param fd File descriptor to write to.
+ * @param pc Return address of the innermost frame.
+ * @param fp Frame pointer of the frame pc returns to.
+ * @param low Lowest address of the stack that can be read.
+ * @param high Address just above the top of the stack.
+ * @param printFrame Prints each frame: dumpFrame, or dumpRawFrame in a signal handler.
+ */
+static void dumpBacktrace(int fd, address_t pc, address_t fp, address_t low, address_t high,
+                          void (*printFrame)(int, int, address_t))
 {
-	if (me != nullptr)
-	{
-		// Scheduler has already been instantiated once, so throw exception.
-		throw SchedulerException();
-	}
-
-	// Keep a pointer to this instance.
-    me = this;
-
-
-	// Set timers for all possible quantums:
-	for (const auto &quant: pQuantums)
+    printFrame(fd, 0, pc);
+    for (int depth = 1; depth < MAX_DUMP_FRAMES; ++depth)
     {
-        itimerval timer{};
-        timer.it_interval.tv_sec = 0;
-        timer.it_interval.tv_usec = 0;
-        __suseconds_t usecs = quant.second;
-        __time_t seconds = 0;
-        while (usecs > MAX_MILISECONDS)
+        // Stop at a frame pointer that does not point into the stack, or does not go up it:
+        if (fp < low || fp > high - 2 * sizeof(address_t) || fp % sizeof(address_t) != 0)
+        {
+            return;
+        }
+        auto frame = (const address_t *) fp;
+        if (frame[1] == 0)
         {
-        	// Number of milliseconds is longer than a second.
-            ++seconds;
-            usecs -= MAX_MILISECONDS;
+            return;
         }
-        timer.it_value.tv_sec = seconds;
-        timer.it_value.tv_usec = usecs;
-        quantums[quant.first] = timer;
+        printFrame(fd, depth, frame[1]);
+        if (frame[0] <= fp)
+        {
+            return;
+        }
+        fp = frame[0];
     }
+}
 
-	// Set the sigaction handler for the timer:
-    sa.sa_handler = &Scheduler::timerHandler;
-    if (sigaction(SIGVTALRM, &sa, nullptr) < 0)
+/**
+ * Get the current monotonic time in microseconds.
+ */
+static long long monotonicUsecs()
+{
+    timespec now{};
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
     {
-        std::cerr << SYS_ERROR_SIGACTION;
+        std::cerr << SYS_ERROR_CLOCK_GETTIME;
         exit(EXIT_FAILURE);
     }
+    return (long long) now.tv_sec * USECS_PER_SEC + now.tv_nsec / 1000;
+}
 
-    // Create the main thread as thread with ID 0:
-    try
-    {
-        auto mainThread = std::make_shared<Thread>(MAIN_THREAD_ID, MAIN_THREAD_PRIORITY, nullptr,
-                                                   true);
-        running = mainThread;
-        threads[MAIN_THREAD_ID] = mainThread;
-        setTimer(MAIN_THREAD_PRIORITY);
-    }
-    catch (std::bad_alloc &e)
+/**
+ * Get the cpu time the calling kernel thread used, in microseconds. Unlike the virtual timer,
+ * which only moves in whole clock ticks, this counts runs shorter than a tick too.
+ */
+static long long threadCpuUsecs()
+{
+    timespec now{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now))
     {
-        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        std::cerr << SYS_ERROR_CLOCK_GETTIME;
         exit(EXIT_FAILURE);
     }
+    return (long long) now.tv_sec * USECS_PER_SEC + now.tv_nsec / 1000;
 }
 
-void Scheduler::setTimer(int priority)
+/**
+ * Whether the process has kernel threads other than the calling one, which could post resumes.
+ * Assumes it has if that cannot be told.
+ */
+static bool hasOtherKernelThreads()
 {
-	// Set the timer for a quantum corresponding to priority.
-    if (setitimer(ITIMER_VIRTUAL, &quantums[priority], nullptr))
+    char stat[1024];
+    int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
     {
-        std::cerr << SYS_ERROR_SETITIMER;
-        exit(EXIT_FAILURE);
+        return true;
+    }
+    ssize_t length = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return true;
+    }
+    stat[length] = '\0';
+    // The thread count is the 20th field. The 2nd is the command name in parentheses, which may
+    // have spaces in it, so count the fields from its end:
+    const char *field = strrchr(stat, ')');
+    for (int i = 2; field != nullptr && i < 20; ++i)
+    {
+        field = strchr(field + 1, ' ');
     }
+    return field == nullptr || strtol(field + 1, nullptr, 10) > 1;
 }
 
-int Scheduler::addThread(Thread::EntryPoint_t entryPoint, int priority)
+Stack::Stack(size_t initialSize, size_t maxSize)
+        : base(nullptr), committed(nullptr), size(STACK_SIZE), initialSize(initialSize),
+          prev(nullptr), next(nullptr)
 {
-	// If there are already MAX_THREAD_NUM threads, return a failure.
-    if (numOfThreads == MAX_THREAD_NUM || !quantums.count(priority))
+    if (pageSize == 0)
     {
-        std::cerr << ADD_THREAD_ERR_MSG << priority << '\n';
-        return FAILURE;
+        pageSize = (size_t) sysconf(_SC_PAGESIZE);
     }
-
-    try
+    if (initialSize == 0)
     {
-    	// Find the lowest free ID:
-        int lowest_id = 1;
-        for (int i = 0; i < MAX_THREAD_NUM; ++i)
+        // Align to pages, so the stack's pages are its own and can be faulted in again:
+        if (posix_memalign((void **) &base, pageSize, STACK_SIZE))
         {
-            if (threads[i] == nullptr)
-            {
-				lowest_id = i;
-                break;
-            }
+            throw std::bad_alloc();
         }
-        // Make sure there aren't any pointers to threads with this ID in the ready queue:
-        ready.erase(
-                std::remove_if(ready.begin(), ready.end(), [lowest_id](const std::shared_ptr<Thread> &ptr)
-                {
-                    return ptr->getId() == lowest_id;
-                }), ready.end());
+        committed = base;
+        return;
+    }
+    // Round the sizes up to whole pages:
+    this->initialSize = (initialSize + pageSize - 1) / pageSize * pageSize;
+    size = (maxSize + pageSize - 1) / pageSize * pageSize;
 
-        // Create the thread and add it to the queue, then return its ID:
-        threads[lowest_id] = std::make_shared<Thread>(lowest_id, priority, entryPoint);
-        ++numOfThreads;
-        ready.push_back(threads[lowest_id]);
-        return lowest_id;
-    } catch (std::bad_alloc &e)
+    // Reserve the stack and a guard page below it, then commit the initial top pages:
+    void *region = mmap(nullptr, size + pageSize, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
     {
-        std::cerr << SYS_ERROR_MEMORY_ALLOC;
-        exit(EXIT_FAILURE);
+        throw std::bad_alloc();
     }
+    base = (char *) region;
+    committed = getTop() - this->initialSize;
+    if (mprotect(committed, this->initialSize, PROT_READ | PROT_WRITE))
+    {
+        munmap(base, size + pageSize);
+        throw std::bad_alloc();
+    }
+
+    // Publish the stack to the SIGSEGV handler only once it is complete:
+    next = growable;
+    if (next != nullptr)
+    {
+        next->prev = this;
+    }
+    std::atomic_signal_fence(std::memory_order_release);
+    growable = this;
 }
 
-void Scheduler::timerHandler(int)
+Stack::~Stack()
 {
-    if (me->ready.empty())
+    if (initialSize == 0)
     {
-    	// There are no threads in the queue, so keep running until the timer goes again.
-		me->setTimer(me->running->getPriority());
-		return;
+        free(base);
+        return;
     }
-    auto runningId = me->running->getId();
-
-    if (runningId != me->ready.front()->getId())
+    // Unlink before unmapping; a single store hides the stack from the SIGSEGV handler:
+    if (prev != nullptr)
     {
-    	// Only if this thread is not also next in the queue, push it to the back.
-        me->ready.push_back(std::shared_ptr<Thread>(me->running));
+        prev->next = next;
     }
-
-    std::shared_ptr<Thread> prev = me->running;
-
-    // Get the next thread:
-    me->running = std::shared_ptr<Thread>(me->ready.front());
-    me->ready.pop_front();
-    while (me->running->getState() == Thread::TERMINATED ||
-           me->running->getState() == Thread::BLOCKED)
+    else
     {
-    	// Skip all the thread that are terminated or blocked:
-        if (me->ready.empty())
-        {
-			me->setTimer(me->running->getPriority());
-			return;
-        }
-        me->running = std::shared_ptr<Thread>(me->ready.front());
-        me->ready.pop_front();
+        growable = next;
     }
-
-    // Set the timer for the next thread and preform the context switch:
-    me->setTimer(me->running->getPriority());
-    if (prev->getId() != me->running->getId())
+    if (next != nullptr)
     {
-        me->dispatcher.switchToThread(std::move(prev), me->running);
+        next->prev = prev;
     }
+    std::atomic_signal_fence(std::memory_order_release);
+    munmap(base, size + pageSize);
 }
 
-int Scheduler::changePriority(int tid, int priority)
+char *Stack::getTop() const
 {
-    if (threads[tid] == nullptr || !quantums.count(priority))
-    {
-        std::cerr << CHANGE_PRIORITY_ERR_MSG << tid << " to " << priority << ".\n";
-        return FAILURE;
-    }
-    threads[tid]->setPriority(priority);
-    return SUCCESS;
+    return initialSize == 0 ? base + size : base + pageSize + size;
 }
 
-int Scheduler::terminate(int tid)
+char *Stack::getBottom() const
 {
-    if (threads[tid] == nullptr)
+    return committed;
+}
+
+bool Stack::grow(char *address)
+{
+    char *limit = base + pageSize;
+    if (initialSize == 0 || committed == limit)
     {
-        std::cerr << TERMINATION_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
-        return FAILURE;
+        return false;
     }
-    // Set the thread as terminated:
-    threads[tid]->setState(Thread::TERMINATED);
-    --numOfThreads;
+    // Grow by at least the committed size, so a deep thread faults only a few times:
+    size_t used = (size_t) (getTop() - committed);
+    char *target = committed - std::min(used, (size_t) (committed - limit));
+    if (address < limit)
+    {
+        target = limit;
+    }
+    else if (address < target)
+    {
+        target = (char *) ((address_t) address / pageSize * pageSize);
+    }
+    if (mprotect(target, (size_t) (committed - target), PROT_READ | PROT_WRITE))
+    {
+        return false;
+    }
+    committed = target;
+    return true;
+}
 
-    if (tid == MAIN_THREAD_ID)
+void Stack::shrink()
+{
+    char *initial = getTop() - initialSize;
+    if (initialSize == 0 || committed == initial)
     {
-    	// Main thread was terminated, so exit the program.
-        clearAndExit();
+        return;
     }
-    if (running->getId() == tid)
+    // Drop the contents of the extra pages so they no longer take memory:
+    madvise(committed, (size_t) (initial - committed), MADV_DONTNEED);
+    mprotect(committed, (size_t) (initial - committed), PROT_NONE);
+    committed = initial;
+}
+
+void Stack::refault()
+{
+    shrink();
+    // Pages of a fixed stack that is not a whole number of pages are shared with the heap:
+    size_t length = (size_t) (getTop() - committed) / pageSize * pageSize;
+    madvise(committed, length, MADV_DONTNEED);
+#ifdef MADV_POPULATE_WRITE
+    // Fault them in now rather than on the thread's first run; older kernels leave that to it:
+    madvise(committed, length, MADV_POPULATE_WRITE);
+#endif
+}
+
+Stack *Stack::find(const char *address)
+{
+    for (Stack *stack = growable; stack != nullptr; stack = stack->next)
     {
-    	// Put this thread in the queue so that its resources will be freed by a future thread
-    	// when it comes out of the queue:
-        ready.push_back(std::shared_ptr<Thread>(threads[tid]));
-		// Running thread was terminated, so get the next thread:
-		auto previous = running;
-        running = std::shared_ptr<Thread>(ready.front());
-        while (running->getState() == Thread::TERMINATED ||
-               running->getState() == Thread::BLOCKED)
+        if (address >= stack->base && address < stack->getTop())
         {
-            ready.pop_front();
-            if (ready.empty())
-            {
-                running = threads[MAIN_THREAD_ID];
-            }
-            else
-            {
-                running = std::shared_ptr<Thread>(ready.front());
-            }
+            return stack;
         }
-        // Release the pointer to this thread and switch:
-        threads[tid].reset();
-        dispatcher.switchToThread(std::move(previous), running);
     }
-    // Release the pointer to this thread:
-    threads[tid].reset();
-    return SUCCESS;
+    return nullptr;
 }
 
-void Scheduler::clearAndExit()
+Arena::Arena() : newest(nullptr), current(nullptr), end(nullptr), size(0)
 {
-	// Release all the pointers so resources are all freed:
-    running.reset();
-    ready.clear();
-    for (auto &thread : threads)
+}
+
+Arena::~Arena()
+{
+    while (newest != nullptr)
     {
-        thread.reset();
+        Chunk *previous = newest->previous;
+        munmap(newest, newest->size);
+        newest = previous;
     }
-    sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGVTALRM, &sa, nullptr) < 0)
+}
+
+void *Arena::allocate(size_t size, size_t alignment)
+{
+    // Bump the current chunk if the allocation fits in what is left of it:
+    auto address = ((uintptr_t) current + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    if (current != nullptr && address <= (uintptr_t) end && size <= (uintptr_t) end - address)
     {
-        std::cerr << SYS_ERROR_SIGACTION;
-        exit(EXIT_FAILURE);
+        current = (char *) (address + size);
+        return (void *) address;
     }
-    exit(EXIT_SUCCESS);
+    return allocateChunk(size, alignment);
 }
 
-int Scheduler::block(int tid)
+void *Arena::allocateChunk(size_t size, size_t alignment)
 {
-    if (tid == MAIN_THREAD_ID || threads[tid] == nullptr)
+    // Double the last chunk, or more if the allocation needs it:
+    size_t chunkSize = newest == nullptr ? ARENA_CHUNK_SIZE :
+                       std::min(newest->size * 2, (size_t) ARENA_MAX_CHUNK_SIZE);
+    if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 2)
     {
-    	// It's an error to block the main thread.
-        std::cerr << BLOCK_ERR_MSG << tid << '\n';
-        return FAILURE;
+        return nullptr;
     }
-    // Set the state as blocked:
-    threads[tid]->setState(Thread::BLOCKED);
-    if (tid != running->getId())
+    size_t needed = sizeof(Chunk) + alignment + size;
+    if (needed > chunkSize)
     {
-    	// Remove all pointers to this thread from the ready queue:
-		ready.erase(
-				std::remove_if(ready.begin(), ready.end(), [tid](const std::shared_ptr<Thread> &ptr)
-				{
-					return ptr->getId() == tid;
-				}), ready.end());
+        size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+        chunkSize = (needed + pageSize - 1) / pageSize * pageSize;
     }
-    else
+    void *region = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (region == MAP_FAILED)
     {
-    	// Get the next thread:
-        running = std::shared_ptr<Thread>(ready.front());
-        while (running->getState() == Thread::TERMINATED ||
-               running->getState() == Thread::BLOCKED)
-        {
-            ready.pop_front();
-            if (ready.empty())
-            {
-                running = threads[MAIN_THREAD_ID];
-            }
-            else
-            {
-                running = std::shared_ptr<Thread>(ready.front());
-            }
-        }
-        // Preform the context switch:
-        dispatcher.switchToThread(std::shared_ptr<Thread>(threads[tid]), running);
+        return nullptr;
     }
-    return SUCCESS;
+    auto chunk = (Chunk *) region;
+    chunk->previous = newest;
+    chunk->size = chunkSize;
+    newest = chunk;
+    this->size += chunkSize;
+    current = (char *) (chunk + 1);
+    end = (char *) chunk + chunkSize;
+    return allocate(size, alignment);
 }
 
-int Scheduler::resume(int tid)
+void Arena::release()
 {
-    if (threads[tid] == nullptr)
+    if (newest == nullptr)
     {
-        std::cerr << RESUME_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
-        return FAILURE;
+        return;
     }
-    if (threads[tid]->getState() == Thread::BLOCKED)
+    while (newest->previous != nullptr)
     {
-    	// If the thread was indeed blocked, add it back to the queue:
-        ready.push_back(std::shared_ptr<Thread>(threads[tid]));
-        threads[tid]->setState(Thread::READY);
+        Chunk *previous = newest->previous;
+        munmap(newest, newest->size);
+        newest = previous;
     }
-    return SUCCESS;
+    size = newest->size;
+    current = (char *) (newest + 1);
+    end = (char *) newest + newest->size;
 }
 
-int Scheduler::getRunningId()
+size_t Arena::getSize() const
 {
-    return running->getId();
+    return size;
 }
 
-int Scheduler::getTotalQuantums()
+Thread::Thread(int id, int priority, EntryPoint_t entry, bool mainThread,
+               size_t initialStackSize, size_t maxStackSize)
+        : id(id), basePriority(priority), waitingOn(NO_MUTEX), waitingFd(NO_FD),
+          readyEvents(0), entry(nullptr), stack(nullptr),
+          deadline{0, 0, 0, 0, false}, adaptation{0, 0, 0, 0, 0}
 {
-    return dispatcher.getTotalQuantums();
+    sigsetjmp(environment, SAVE_SIGNAL_MASK);
+    if (!mainThread)
+    {
+    	// Creating a new thread, set environment and allcoate a stack.
+        stack = std::unique_ptr<Stack>(new Stack(initialStackSize, maxStackSize));
+        setupEnvironment(entry);
+    }
 }
 
-int Scheduler::getThreadsQuantums(int tid)
+void Thread::setupEnvironment(EntryPoint_t _entry)
 {
-    if (threads[tid] == nullptr)
+    entry = _entry;
+    address_t sp = (address_t) stack->getTop() - sizeof(address_t);
+    auto pc = (address_t) &Scheduler::startThread;
+    (environment->__jmpbuf)[JB_SP] = translate_address(sp);
+    (environment->__jmpbuf)[JB_PC] = translate_address(pc);
+    // No frames below the entry point, so that backtraces stop there:
+    (environment->__jmpbuf)[JB_BP] = translate_frame_pointer(0);
+    if (sigemptyset(&environment->__saved_mask) ||
+        sigaddset(&environment->__saved_mask, SIGVTALRM))
     {
-        std::cerr << QUANTUM_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
-        return FAILURE;
+        std::cerr << SYS_ERROR_SIGEMPTYSET;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void Thread::reset(int _id, int _priority, EntryPoint_t entry)
+{
+    id = _id;
+    basePriority = _priority;
+    waitingOn = NO_MUTEX;
+    waitingFd = NO_FD;
+    readyEvents = 0;
+    heldMutexes.clear();
+    deadline = Deadline{0, 0, 0, 0, false};
+    adaptation = Adaptation{0, 0, 0, 0, 0};
+    arena.release();
+    stack->shrink();
+#ifdef __SANITIZE_ADDRESS__
+    // The frames the previous thread left on the stack are still poisoned, since it never
+    // returned from them:
+    ASAN_UNPOISON_MEMORY_REGION(stack->getBottom(), stack->getTop() - stack->getBottom());
+#endif
+    setupEnvironment(entry);
+}
+
+Thread::EntryPoint_t Thread::getEntry() const
+{
+    return entry;
+}
+
+sigjmp_buf &Thread::getEnvironment()
+{
+    return environment;
+}
+
+int Thread::getId() const
+{
+    return id;
+}
+
+int Thread::getBasePriority() const
+{
+    return basePriority;
+}
+
+void Thread::setBasePriority(int _priority)
+{
+    basePriority = _priority;
+}
+
+int Thread::getWaitingOn() const
+{
+    return waitingOn;
+}
+
+void Thread::setWaitingOn(int mid)
+{
+    waitingOn = mid;
+}
+
+int Thread::getWaitingFd() const
+{
+    return waitingFd;
+}
+
+void Thread::setWaitingFd(int fd)
+{
+    waitingFd = fd;
+}
+
+int Thread::getReadyEvents() const
+{
+    return readyEvents;
+}
+
+void Thread::setReadyEvents(int events)
+{
+    readyEvents = events;
+}
+
+std::vector<int> &Thread::getHeldMutexes()
+{
+    return heldMutexes;
+}
+
+Thread::Deadline &Thread::getDeadline()
+{
+    return deadline;
+}
+
+Thread::Adaptation &Thread::getAdaptation()
+{
+    return adaptation;
+}
+
+void Thread::refaultStack()
+{
+    stack->refault();
+}
+
+const Stack *Thread::getStack() const
+{
+    return stack.get();
+}
+
+Arena &Thread::getArena()
+{
+    return arena;
+}
+
+ReadyRing::ReadyRing() : entries(new ReadyEntry[MAX_THREAD_NUM]), head(0), size(0)
+{
+}
+
+bool ReadyRing::isEmpty() const
+{
+    return size == 0;
+}
+
+const ReadyEntry &ReadyRing::front() const
+{
+    return entries[head];
+}
+
+void ReadyRing::pushBack(const ReadyEntry &entry)
+{
+    at(size++) = entry;
+}
+
+void ReadyRing::popFront()
+{
+    head = (head + 1) % MAX_THREAD_NUM;
+    --size;
+}
+
+ReadyEntry ReadyRing::remove(int tid)
+{
+    int i = 0;
+    while (at(i).tid != tid)
+    {
+        ++i;
+    }
+    // Close the gap by moving the entries behind it forward:
+    ReadyEntry entry = at(i);
+    for (; i + 1 < size; ++i)
+    {
+        at(i) = at(i + 1);
+    }
+    --size;
+    return entry;
+}
+
+void ReadyRing::insert(const ReadyEntry &entry)
+{
+    // Move the entries queued after it back by one:
+    int i = size++;
+    while (i > 0 && at(i - 1).order > entry.order)
+    {
+        at(i) = at(i - 1);
+        --i;
+    }
+    at(i) = entry;
+}
+
+ReadyEntry &ReadyRing::at(int i)
+{
+    return entries[(head + i) % MAX_THREAD_NUM];
+}
+
+WakeQueue::WakeQueue() : head(NO_THREAD)
+{
+    for (int tid = 0; tid < MAX_THREAD_NUM; ++tid)
+    {
+        next[tid].store(NO_THREAD, std::memory_order_relaxed);
+        queued[tid].store(false, std::memory_order_relaxed);
+    }
+    doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (doorbell < 0)
+    {
+        std::cerr << SYS_ERROR_EVENTFD;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void WakeQueue::post(int tid)
+{
+    if (queued[tid].exchange(true, std::memory_order_acquire))
+    {
+        // Already queued and not taken yet.
+        return;
+    }
+    // The consumer only ever takes the whole stack, so pushing is safe from ABA:
+    int old = head.load(std::memory_order_relaxed);
+    do
+    {
+        next[tid].store(old, std::memory_order_relaxed);
+    } while (!head.compare_exchange_weak(old, tid, std::memory_order_release,
+                                         std::memory_order_relaxed));
+    if (old == NO_THREAD)
+    {
+        // Ring only when the queue becomes non empty; a full counter just stays readable.
+        uint64_t one = 1;
+        ssize_t ignored = write(doorbell, &one, sizeof(one));
+        (void) ignored;
+    }
+}
+
+int WakeQueue::takeAll(int tids[MAX_THREAD_NUM])
+{
+    if (isEmpty())
+    {
+        return 0;
+    }
+    // Clear the doorbell before taking the stack: a request posted after that finds the stack
+    // empty and rings again, so the doorbell is never left clear while requests are queued.
+    uint64_t count;
+    ssize_t ignored = read(doorbell, &count, sizeof(count));
+    (void) ignored;
+    int tid = head.exchange(NO_THREAD, std::memory_order_acquire);
+
+    // The stack holds the latest request first; read each link before the ID may be posted
+    // again:
+    int taken = 0;
+    while (tid != NO_THREAD)
+    {
+        tids[taken++] = tid;
+        int following = next[tid].load(std::memory_order_relaxed);
+        queued[tid].store(false, std::memory_order_release);
+        tid = following;
+    }
+    std::reverse(tids, tids + taken);
+    return taken;
+}
+
+bool WakeQueue::isEmpty() const
+{
+    return head.load(std::memory_order_relaxed) == NO_THREAD;
+}
+
+int WakeQueue::getDoorbell() const
+{
+    return doorbell;
+}
+
+Snapshot::Snapshot() : local(), sharedName()
+{
+    local.max_threads = MAX_THREAD_NUM;
+    local.running_tid = NO_THREAD;
+    uthread_live_snapshot.store(&local, std::memory_order_release);
+}
+
+uthread_snapshot &Snapshot::beginWrite()
+{
+    uthread_snapshot *target = uthread_live_snapshot.load(std::memory_order_relaxed);
+    __atomic_store_n(&target->sequence, target->sequence + 1, __ATOMIC_RELAXED);
+    // Keep the updates after the odd sequence:
+    std::atomic_thread_fence(std::memory_order_release);
+    return *target;
+}
+
+void Snapshot::endWrite()
+{
+    uthread_snapshot *target = uthread_live_snapshot.load(std::memory_order_relaxed);
+    __atomic_store_n(&target->sequence, target->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void Snapshot::clear()
+{
+    uthread_snapshot &shared = beginWrite();
+    memset(shared.threads, 0, sizeof(shared.threads));
+    shared.total_quantums = 0;
+    shared.running_tid = NO_THREAD;
+    shared.num_of_threads = 0;
+    endWrite();
+}
+
+int Snapshot::share(const char *name)
+{
+    if (name == nullptr)
+    {
+        if (sharedName[0] != '\0' && shm_unlink(sharedName) < 0)
+        {
+            std::cerr << SNAPSHOT_SHARE_ERR_MSG << sharedName << ": " << strerror(errno) << ".\n";
+            return FAILURE;
+        }
+        sharedName[0] = '\0';
+        return SUCCESS;
+    }
+    if (uthread_live_snapshot.load(std::memory_order_relaxed) != &local ||
+        strlen(name) > NAME_MAX)
+    {
+        std::cerr << SNAPSHOT_SHARE_ERR_MSG << name << ": Already shared or name too long.\n";
+        return FAILURE;
+    }
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << SNAPSHOT_SHARE_ERR_MSG << name << ": " << strerror(errno) << ".\n";
+        return FAILURE;
+    }
+    void *region = MAP_FAILED;
+    if (ftruncate(fd, sizeof(uthread_snapshot)) == 0)
+    {
+        region = mmap(nullptr, sizeof(uthread_snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (region == MAP_FAILED)
+    {
+        std::cerr << SNAPSHOT_SHARE_ERR_MSG << name << ": " << strerror(errno) << ".\n";
+        close(fd);
+        shm_unlink(name);
+        return FAILURE;
+    }
+    close(fd);
+
+    // Copy the snapshot, leaving the sequence even, and switch the writer and readers to it. The
+    // local copy stays valid for readers that are still at it.
+    auto shared = (uthread_snapshot *) region;
+    memcpy(shared, &local, sizeof(local));
+    shared->sequence = 0;
+    uthread_live_snapshot.store(shared, std::memory_order_release);
+    strcpy(sharedName, name);
+    return SUCCESS;
+}
+
+int Snapshot::read(const uthread_snapshot *source, uthread_snapshot *copy) const
+{
+    if (source == nullptr)
+    {
+        source = uthread_live_snapshot.load(std::memory_order_acquire);
+    }
+    for (int attempt = 0; attempt < MAX_SNAPSHOT_ATTEMPTS; ++attempt)
+    {
+        unsigned int begin = __atomic_load_n(&source->sequence, __ATOMIC_ACQUIRE);
+        if (begin % 2 == 0)
+        {
+            memcpy(copy, source, sizeof(*copy));
+            // Keep the copy before the second read of the sequence:
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (__atomic_load_n(&source->sequence, __ATOMIC_RELAXED) == begin)
+            {
+                return SUCCESS;
+            }
+        }
+        // The writer is in the middle of an update, possibly descheduled:
+        sched_yield();
+    }
+    std::cerr << TLERROR_SNAPSHOT_TORN;
+    return FAILURE;
+}
+
+Dispatcher::Dispatcher() : totalQuantums(INITIAL_QUANTUMS)
+{
+}
+
+void Dispatcher::countQuantum()
+{
+    ++totalQuantums;
+}
+
+void Dispatcher::switchToThread(std::shared_ptr<Thread> &&currentThread,
+                                const std::shared_ptr<Thread> &targetThread)
+{
+    // Save current state
+    int ret_val = sigsetjmp(currentThread->getEnvironment(), SAVE_SIGNAL_MASK);
+    if (ret_val == 1)
+    {
+		return;
+	}
+    // Before jumping, release the pointer for the old thread.
+	currentThread.reset();
+
+    // Preform context switch.
+	siglongjmp(targetThread->getEnvironment(), 1);
+}
+
+int Dispatcher::getTotalQuantums() const
+{
+    return totalQuantums;
+}
+
+Scheduler::Scheduler(const std::map<int, int> &pQuantums) : numOfThreads(INITIAL_NUM_OF_THREADS),
+                                                            numOfFreeIds(MAX_THREAD_NUM -
+                                                                         INITIAL_NUM_OF_THREADS),
+                                                            poolCapacity(0), initialStackSize(0),
+                                                            maxStackSize(0), minQuantum(0),
+                                                            maxQuantum(0), dumpSignal(0),
+                                                            mainStackBottom(nullptr),
+                                                            mainStackTop(nullptr),
+                                                            enqueues(0), agingQuanta(0),
+                                                            epollFd(-1), numOfFdWaiters(0),
+                                                            sliceUsecs(0), sliceStart(0)
+{
+	// Keep a pointer to this instance, and release the thread that shut the previous one down:
+    me = this;
+    orphan.reset();
+
+    // Requests posted before this instance refer to threads of the previous one:
+    wakeups.takeAll(woken);
+
+
+	// Set timers for all possible quantums, and a ready queue for each priority:
+	for (const auto &quant: pQuantums)
+    {
+        quantums[quant.first] = usecsToTimer(quant.second);
+    }
+    ready.resize(pQuantums.empty() ? 0 : (size_t) pQuantums.rbegin()->first + 1);
+    std::fill(queuedAt, queuedAt + MAX_THREAD_NUM, NOT_QUEUED);
+    // All the IDs but the main thread's are free; ascending order is already a min-heap:
+    std::iota(freeIds, freeIds + numOfFreeIds, MAIN_THREAD_ID + 1);
+    // Leave room for stale heap entries too, so enqueue only compacts the heap once in a while:
+    deadlines.reserve(2 * MAX_THREAD_NUM);
+
+#ifndef UTHREADS_COOPERATIVE
+	// Set the sigaction handler for the timer:
+    sa.sa_sigaction = &Scheduler::timerHandler;
+    sa.sa_flags = SA_SIGINFO;
+    if (sigaction(SIGVTALRM, &sa, &oldSa) < 0)
+    {
+        std::cerr << SYS_ERROR_SIGACTION;
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // Create the main thread as thread with ID 0:
+    try
+    {
+        auto mainThread = std::make_shared<Thread>(MAIN_THREAD_ID, MAIN_THREAD_PRIORITY, nullptr,
+                                                   true);
+        running = mainThread;
+        threads[MAIN_THREAD_ID] = mainThread;
+        table.state[MAIN_THREAD_ID] = Thread::READY;
+        table.priority[MAIN_THREAD_ID] = MAIN_THREAD_PRIORITY;
+        table.totalQuantum[MAIN_THREAD_ID] = INITIAL_QUANTUMS;
+        setTimer(MAIN_THREAD_ID);
+        snapshot.clear();
+        publish(MAIN_THREAD_ID);
+    }
+    catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    // The threads, stacks and mutexes are released with the members.
+    stopPreemption();
+    setDumpSignal(0);
+    snapshot.clear();
+    if (epollFd >= 0)
+    {
+        close(epollFd);
+    }
+    me = nullptr;
+}
+
+bool Scheduler::shutdown()
+{
+    if (running->getId() == MAIN_THREAD_ID)
+    {
+        return false;
+    }
+    // We are running on this thread's stack, so keep it until the next instance is created:
+    orphan = running;
+    memcpy(mainEnvironment, threads[MAIN_THREAD_ID]->getEnvironment(), sizeof(sigjmp_buf));
+    return true;
+}
+
+void Scheduler::resumeMain()
+{
+    siglongjmp(mainEnvironment, 1);
+}
+
+void Scheduler::startThread()
+{
+    Thread::EntryPoint_t entry = me->running->getEntry();
+#ifndef UTHREADS_COOPERATIVE
+    sigset_t timerSignal;
+    if (sigemptyset(&timerSignal) || sigaddset(&timerSignal, SIGVTALRM))
+    {
+        std::cerr << SYS_ERROR_SIGEMPTYSET;
+        exit(EXIT_FAILURE);
+    }
+    if (sigprocmask(SIG_UNBLOCK, &timerSignal, nullptr))
+    {
+        std::cerr << SYS_ERROR_SIGPROCMASK;
+        exit(EXIT_FAILURE);
+    }
+#endif
+    entry();
+}
+
+void Scheduler::stopPreemption()
+{
+#ifndef UTHREADS_COOPERATIVE
+    itimerval stop{};
+    if (setitimer(ITIMER_VIRTUAL, &stop, nullptr))
+    {
+        std::cerr << SYS_ERROR_SETITIMER;
+        exit(EXIT_FAILURE);
+    }
+    // Ignoring the signal first discards it if it is pending:
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    if (sigaction(SIGVTALRM, &sa, nullptr) < 0 || sigaction(SIGVTALRM, &oldSa, nullptr) < 0)
+    {
+        std::cerr << SYS_ERROR_SIGACTION;
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+void Scheduler::setTimer(int tid)
+{
+	// Set the timer for a quantum corresponding to priority, or what is left of the budget:
+    itimerval timer = maxQuantum == 0 ? quantums[table.priority[tid]] :
+                      usecsToTimer(threads[tid]->getAdaptation().quantum);
+    sliceUsecs = timeToUsecs(timer.it_value);
+    if (isReleased(tid) && threads[tid]->getDeadline().remaining < sliceUsecs)
+    {
+        sliceUsecs = threads[tid]->getDeadline().remaining;
+        timer = usecsToTimer(sliceUsecs);
+    }
+    if (maxQuantum != 0 || isReleased(tid))
+    {
+        // Only budgets and adaptive quantums need to know how long the slice really ran:
+        sliceStart = threadCpuUsecs();
+    }
+#ifndef UTHREADS_COOPERATIVE
+    if (setitimer(ITIMER_VIRTUAL, &timer, nullptr))
+    {
+        std::cerr << SYS_ERROR_SETITIMER;
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+int Scheduler::addThread(Thread::EntryPoint_t entryPoint, int priority)
+{
+	// If there are already MAX_THREAD_NUM threads, return a failure.
+    if (numOfThreads == MAX_THREAD_NUM || !quantums.count(priority))
+    {
+        std::cerr << ADD_THREAD_ERR_MSG << priority << '\n';
+        return FAILURE;
+    }
+
+    try
+    {
+    	// Take the lowest free ID, which is at the top of the heap. Stale ready entries with this
+    	// ID are dropped when it is enqueued:
+        std::pop_heap(freeIds, freeIds + numOfFreeIds, std::greater<int>());
+        int lowest_id = freeIds[--numOfFreeIds];
+
+        // Create the thread and add it to the queue, then return its ID:
+        threads[lowest_id] = createThread(lowest_id, priority, entryPoint);
+        table.state[lowest_id] = Thread::READY;
+        table.priority[lowest_id] = priority;
+        table.totalQuantum[lowest_id] = 0;
+        threads[lowest_id]->getAdaptation().quantum = baseQuantum(lowest_id);
+        ++numOfThreads;
+        enqueue(lowest_id);
+        publish(lowest_id);
+        return lowest_id;
+    } catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::shared_ptr<Thread> Scheduler::createThread(int id, int priority,
+                                                Thread::EntryPoint_t entryPoint)
+{
+    // Look for a parked thread that isn't still held as a zombie:
+    for (auto it = pool.rbegin(); it != pool.rend(); ++it)
+    {
+        if (it->use_count() == 1)
+        {
+            std::shared_ptr<Thread> thread = std::move(*it);
+            *it = std::move(pool.back());
+            pool.pop_back();
+            thread->reset(id, priority, entryPoint);
+            return thread;
+        }
+    }
+    return allocateThread(id, priority, entryPoint);
+}
+
+std::shared_ptr<Thread> Scheduler::allocateThread(int id, int priority,
+                                                  Thread::EntryPoint_t entryPoint)
+{
+    return std::make_shared<Thread>(id, priority, entryPoint, false, initialStackSize,
+                                    maxStackSize);
+}
+
+void Scheduler::recycleThread(const std::shared_ptr<Thread> &thread)
+{
+    if (pool.size() < poolCapacity)
+    {
+        pool.push_back(thread);
+    }
+}
+
+int Scheduler::setPoolCapacity(int capacity)
+{
+    if (capacity < 0)
+    {
+        std::cerr << TLERROR_POOL_NEGATIVE_CAPACITY;
+        return FAILURE;
+    }
+    poolCapacity = (size_t) capacity;
+    try
+    {
+        // Drop parked threads beyond the new capacity, or fill the pool up to it:
+        if (pool.size() > poolCapacity)
+        {
+            pool.resize(poolCapacity);
+        }
+        pool.reserve(poolCapacity);
+        while (pool.size() < poolCapacity)
+        {
+            pool.push_back(allocateThread(MAIN_THREAD_ID, MAIN_THREAD_PRIORITY, nullptr));
+        }
+    } catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+    return SUCCESS;
+}
+
+int Scheduler::setAffinity(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        std::cerr << AFFINITY_ERR_MSG << cpu << ": No such cpu.\n";
+        return FAILURE;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus))
+    {
+        if (errno == EINVAL)
+        {
+            // The cpu is offline or outside of our cpuset.
+            std::cerr << AFFINITY_ERR_MSG << cpu << ": No such cpu.\n";
+            return FAILURE;
+        }
+        std::cerr << SYS_ERROR_SCHED_SETAFFINITY;
+        exit(EXIT_FAILURE);
+    }
+
+    // Parked stacks may have been touched on another node, and reallocating them would only get
+    // the same pages back from the heap, so fault them in again from here:
+    for (const std::shared_ptr<Thread> &thread : pool)
+    {
+        thread->refaultStack();
+    }
+    return SUCCESS;
+}
+
+int Scheduler::setGrowableStacks(int initialSize, int maxSize)
+{
+    if (initialSize < 0 || maxSize < initialSize || (initialSize == 0) != (maxSize == 0))
+    {
+        std::cerr << TLERROR_STACK_SIZES;
+        return FAILURE;
+    }
+    if (initialSize > 0)
+    {
+        installFaultHandler();
+    }
+    initialStackSize = (size_t) initialSize;
+    maxStackSize = (size_t) maxSize;
+
+    // Parked threads have the old kind of stack, so reallocate them:
+    pool.clear();
+    return setPoolCapacity((int) poolCapacity);
+}
+
+void Scheduler::timerHandler(int, siginfo_t *, void *context)
+{
+    me->writeRequestedRawDump((const ucontext_t *) context);
+    me->endRun(true);
+    me->preempt();
+}
+
+void Scheduler::installFaultHandler()
+{
+    if (faultHandlerInstalled)
+    {
+        return;
+    }
+    stack_t altStack{};
+    altStack.ss_sp = signalStack;
+    altStack.ss_size = SIGNAL_STACK_SIZE;
+    if (sigaltstack(&altStack, nullptr))
+    {
+        std::cerr << SYS_ERROR_SIGALTSTACK;
+        exit(EXIT_FAILURE);
+    }
+    // Keep SIGVTALRM blocked in the handler, so the timer handler never runs on the alternate
+    // stack:
+    struct sigaction faultSa = {{nullptr}};
+    faultSa.sa_sigaction = &Scheduler::faultHandler;
+    faultSa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    if (sigemptyset(&faultSa.sa_mask) || sigaddset(&faultSa.sa_mask, SIGVTALRM))
+    {
+        std::cerr << SYS_ERROR_SIGEMPTYSET;
+        exit(EXIT_FAILURE);
+    }
+    if (sigaction(SIGSEGV, &faultSa, &oldFaultSa) < 0)
+    {
+        std::cerr << SYS_ERROR_SIGACTION;
+        exit(EXIT_FAILURE);
+    }
+    faultHandlerInstalled = true;
+}
+
+void Scheduler::faultHandler(int, siginfo_t *info, void *context)
+{
+    auto sp = (char *) ((ucontext_t *) context)->uc_mcontext.gregs[REG_SP];
+    // The kernel reports a signal frame it could not push with no address; that signal is lost:
+    bool lostSignal = info->si_code == SI_KERNEL;
+    char *address = lostSignal ? sp : (char *) info->si_addr;
+    Stack *stack = Stack::find(address);
+    if (stack != nullptr && stack->grow(std::min(address, sp) - STACK_FAULT_MARGIN))
+    {
+#ifndef UTHREADS_COOPERATIVE
+        if (lostSignal)
+        {
+            // Only the timer signal is delivered on thread stacks; it is raised again once
+            // this handler returns.
+            raise(SIGVTALRM);
+        }
+#endif
+        return;
+    }
+    // Not a growable stack running out: let the previous action handle the fault, which
+    // happens again once this handler returns.
+    sigaction(SIGSEGV, &oldFaultSa, nullptr);
+    faultHandlerInstalled = false;
+    if (lostSignal)
+    {
+        raise(SIGSEGV);
+    }
+}
+
+void Scheduler::preempt()
+{
+    chargeBudget();
+    if (!hasOtherReady())
+    {
+        // There are no other threads to run, so keep running until the timer goes again.
+        setTimer(running->getId());
+        return;
+    }
+
+    // Put the running thread back in its queue, then get the next thread (there is at least
+    // the running thread):
+    enqueue(running->getId());
+    std::shared_ptr<Thread> prev = running;
+    running = threads[popNextReady()];
+
+    // Preform the context switch, or just start a new timer if the same thread keeps running:
+    if (prev != running)
+    {
+        switchTo(std::move(prev));
+    }
+    else
+    {
+        setTimer(running->getId());
+    }
+}
+
+void Scheduler::endRun(bool expired)
+{
+    if (maxQuantum == 0)
+    {
+        return;
+    }
+    long long ran = usedOfSlice();
+    Thread::Adaptation &adaptation = running->getAdaptation();
+    adaptation.averageRun += (ran - adaptation.averageRun) / ADAPTATION_WEIGHT;
+    adaptation.earlyEnds += ((expired ? 0 : PER_MILLE) - adaptation.earlyEnds) / ADAPTATION_WEIGHT;
+
+    // A thread that uses up its quantum gets fewer switches, and one that mostly gives up the
+    // cpu early gets a quantum that fits its runs:
+    long long quantum = adaptation.quantum;
+    if (expired)
+    {
+        quantum = std::min(maxQuantum, quantum * 2);
+    }
+    else if (adaptation.earlyEnds >= PER_MILLE / 2)
+    {
+        quantum = std::max(minQuantum, std::min(maxQuantum, adaptation.averageRun * 2));
+    }
+    if (quantum > adaptation.quantum)
+    {
+        ++adaptation.grown;
+    }
+    else if (quantum < adaptation.quantum)
+    {
+        ++adaptation.shrunk;
+    }
+    adaptation.quantum = quantum;
+}
+
+long long Scheduler::baseQuantum(int tid)
+{
+    long long quantum = timeToUsecs(quantums[threads[tid]->getBasePriority()].it_value);
+    if (maxQuantum == 0)
+    {
+        return quantum;
+    }
+    return std::max(minQuantum, std::min(maxQuantum, quantum));
+}
+
+int Scheduler::setAdaptiveQuantum(int minUsecs, int maxUsecs)
+{
+    if (minUsecs < 0 || maxUsecs < minUsecs || (minUsecs == 0) != (maxUsecs == 0))
+    {
+        std::cerr << TLERROR_ADAPTIVE_BOUNDS;
+        return FAILURE;
+    }
+    minQuantum = minUsecs;
+    maxQuantum = maxUsecs;
+    // Measure the running thread's run from here, as its slice may have started unmeasured:
+    sliceStart = threadCpuUsecs();
+    // Start all the threads from the quantums of their priorities:
+    for (auto &thread : threads)
+    {
+        if (thread != nullptr)
+        {
+            thread->getAdaptation().quantum = baseQuantum(thread->getId());
+        }
+    }
+    return SUCCESS;
+}
+
+int Scheduler::getStats(int tid, uthread_stats *stats)
+{
+    if (tid < 0 || tid >= MAX_THREAD_NUM || threads[tid] == nullptr || stats == nullptr)
+    {
+        std::cerr << STATS_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
+        return FAILURE;
+    }
+    const Thread::Adaptation &adaptation = threads[tid]->getAdaptation();
+    stats->quantums = table.totalQuantum[tid];
+    stats->quantum_usecs = (int) (maxQuantum == 0 ?
+                                  timeToUsecs(quantums[table.priority[tid]].it_value) :
+                                  adaptation.quantum);
+    stats->average_run_usecs = (int) adaptation.averageRun;
+    stats->early_end_permille = adaptation.earlyEnds;
+    stats->quantums_grown = adaptation.grown;
+    stats->quantums_shrunk = adaptation.shrunk;
+    stats->arena_bytes = (long) threads[tid]->getArena().getSize();
+    return SUCCESS;
+}
+
+int Scheduler::dump(int fd)
+{
+    if (fd < 0)
+    {
+        std::cerr << DUMP_FD_ERR_MSG << fd << ".\n";
+        return FAILURE;
+    }
+    findMainStack();
+    dprintf(fd, "uthreads: %zu threads, %zu parked, %d quantums, thread %d running\n",
+            numOfThreads, pool.size(), dispatcher.getTotalQuantums(), running->getId());
+    for (int tid = 0; tid < MAX_THREAD_NUM; ++tid)
+    {
+        if (threads[tid] != nullptr)
+        {
+            dumpThread(fd, tid);
+        }
+    }
+    return SUCCESS;
+}
+
+void Scheduler::dumpThread(int fd, int tid)
+{
+    const std::shared_ptr<Thread> &thread = threads[tid];
+    static const char *const stateNames[] = {"READY", "BLOCKED", "TERMINATED"};
+    // The running thread may also be blocked, sleeping until some thread can run:
+    bool isRunning = thread == running;
+    dprintf(fd, "thread %d: %s, priority %d (own %d), %d quantums", tid,
+            isRunning && table.state[tid] == Thread::READY ? "RUNNING" :
+            stateNames[table.state[tid]], table.priority[tid],
+            thread->getBasePriority(), table.totalQuantum[tid]);
+    if (thread->getWaitingOn() != NO_MUTEX)
+    {
+        dprintf(fd, ", waiting for mutex %d", thread->getWaitingOn());
+    }
+    if (thread->getWaitingFd() != NO_FD)
+    {
+        dprintf(fd, ", waiting for fd %d", thread->getWaitingFd());
+    }
+    if (thread->getArena().getSize() > 0)
+    {
+        dprintf(fd, ", %zu arena bytes", thread->getArena().getSize());
+    }
+    if (!thread->getHeldMutexes().empty())
+    {
+        dprintf(fd, ", holding %zu mutexes", thread->getHeldMutexes().size());
+    }
+    const Thread::Deadline &deadline = thread->getDeadline();
+    if (deadline.relative > 0)
+    {
+        dprintf(fd, ", deadline %d usecs%s", deadline.relative,
+                deadline.throttled ? " (throttled)" : "");
+    }
+    const Stack *stack = thread->getStack();
+    if (stack != nullptr)
+    {
+        dprintf(fd, ", %ld stack bytes", (long) (stack->getTop() - stack->getBottom()));
+    }
+    dprintf(fd, "\n");
+
+    // Find the stack bounds, for the main thread those of the process's stack:
+    auto low = (address_t) (stack != nullptr ? stack->getBottom() : mainStackBottom);
+    auto high = (address_t) (stack != nullptr ? stack->getTop() : mainStackTop);
+
+    if (isRunning)
+    {
+        // Start from whoever called into the dump:
+        auto frame = (const address_t *) __builtin_frame_address(0);
+        dumpBacktrace(fd, frame[1], frame[0], low, high, dumpFrame);
+        return;
+    }
+    // Start from where the thread was switched out, or from its entry point if it never ran:
+    __jmp_buf &registers = thread->getEnvironment()->__jmpbuf;
+    dumpBacktrace(fd, untranslate_address(registers[JB_PC]),
+                  untranslate_frame_pointer(registers[JB_BP]), low, high, dumpFrame);
+}
+
+void Scheduler::dumpRawThread(int fd, int tid, const ucontext_t *interrupted)
+{
+    const std::shared_ptr<Thread> &thread = threads[tid];
+    static const char *const stateNames[] = {"READY", "BLOCKED", "TERMINATED"};
+    bool isRunning = thread == running;
+    RawLine line{};
+    rawAppend(line, "thread ");
+    rawAppendNumber(line, tid);
+    rawAppend(line, ": ");
+    rawAppend(line, isRunning ? "RUNNING" : stateNames[table.state[tid]]);
+    rawAppend(line, ", priority ");
+    rawAppendNumber(line, table.priority[tid]);
+    rawAppend(line, " (own ");
+    rawAppendNumber(line, thread->getBasePriority());
+    rawAppend(line, "), ");
+    rawAppendNumber(line, table.totalQuantum[tid]);
+    rawAppend(line, " quantums");
+    if (thread->getWaitingOn() != NO_MUTEX)
+    {
+        rawAppend(line, ", waiting for mutex ");
+        rawAppendNumber(line, thread->getWaitingOn());
+    }
+    if (thread->getWaitingFd() != NO_FD)
+    {
+        rawAppend(line, ", waiting for fd ");
+        rawAppendNumber(line, thread->getWaitingFd());
+    }
+    rawAppend(line, "\n");
+    rawWrite(fd, line);
+
+    // The main thread's stack was found when the dump signal was set:
+    const Stack *stack = thread->getStack();
+    auto low = (address_t) (stack != nullptr ? stack->getBottom() : mainStackBottom);
+    auto high = (address_t) (stack != nullptr ? stack->getTop() : mainStackTop);
+
+    if (isRunning)
+    {
+        // Start from where the timer interrupted the thread:
+        const greg_t *registers = interrupted->uc_mcontext.gregs;
+        dumpBacktrace(fd, (address_t) registers[REG_PC], (address_t) registers[REG_FP], low, high,
+                      dumpRawFrame);
+        return;
+    }
+    __jmp_buf &registers = thread->getEnvironment()->__jmpbuf;
+    dumpBacktrace(fd, untranslate_address(registers[JB_PC]),
+                  untranslate_frame_pointer(registers[JB_BP]), low, high, dumpRawFrame);
+}
+
+void Scheduler::findMainStack()
+{
+    if (mainStackTop != nullptr)
+    {
+        return;
+    }
+    pthread_attr_t attributes;
+    void *address = nullptr;
+    size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0)
+    {
+        pthread_attr_getstack(&attributes, &address, &size);
+        pthread_attr_destroy(&attributes);
+    }
+    mainStackBottom = (char *) address;
+    mainStackTop = mainStackBottom + size;
+}
+
+int Scheduler::setDumpSignal(int signum)
+{
+    if (signum < 0 || signum >= NSIG || signum == SIGVTALRM || signum == SIGSEGV ||
+        signum == SIGKILL || signum == SIGSTOP)
+    {
+        std::cerr << DUMP_SIGNAL_ERR_MSG << signum << ".\n";
+        return FAILURE;
+    }
+    // Give the previous signal back its action:
+    if (dumpSignal != 0)
+    {
+        if (sigaction(dumpSignal, &oldDumpSa, nullptr) < 0)
+        {
+            std::cerr << SYS_ERROR_SIGACTION;
+            exit(EXIT_FAILURE);
+        }
+        dumpSignal = 0;
+    }
+    if (signum == 0)
+    {
+        return SUCCESS;
+    }
+    // The timer's handler may write the dump, and cannot look for the main thread's stack:
+    findMainStack();
+    struct sigaction dumpSa = {{nullptr}};
+    dumpSa.sa_handler = &Scheduler::dumpSignalHandler;
+    dumpSa.sa_flags = SA_RESTART;
+    if (sigaction(signum, &dumpSa, &oldDumpSa) < 0)
+    {
+        std::cerr << DUMP_SIGNAL_ERR_MSG << signum << ".\n";
+        return FAILURE;
+    }
+    dumpSignal = signum;
+    return SUCCESS;
+}
+
+void Scheduler::dumpSignalHandler(int)
+{
+    dumpRequested = 1;
+}
+
+void Scheduler::writeRequestedDump()
+{
+    if (dumpRequested)
+    {
+        dumpRequested = 0;
+        dump(STDERR_FILENO);
+    }
+}
+
+void Scheduler::writeRequestedRawDump(const ucontext_t *interrupted)
+{
+    if (!dumpRequested)
+    {
+        return;
+    }
+    dumpRequested = 0;
+    int savedErrno = errno;
+    RawLine line{};
+    rawAppend(line, "uthreads: ");
+    rawAppendNumber(line, (long) numOfThreads);
+    rawAppend(line, " threads, ");
+    rawAppendNumber(line, (long) pool.size());
+    rawAppend(line, " parked, ");
+    rawAppendNumber(line, dispatcher.getTotalQuantums());
+    rawAppend(line, " quantums, thread ");
+    rawAppendNumber(line, running->getId());
+    rawAppend(line, " running (addresses only)\n");
+    rawWrite(STDERR_FILENO, line);
+    for (int tid = 0; tid < MAX_THREAD_NUM; ++tid)
+    {
+        if (threads[tid] != nullptr)
+        {
+            dumpRawThread(STDERR_FILENO, tid, interrupted);
+        }
+    }
+    errno = savedErrno;
+}
+
+int Scheduler::popNextReady()
+{
+    // This is a scheduling point, so let in the threads woken from outside or by their file
+    // descriptors:
+    drainWakeups();
+    pollFds(false);
+
+    while (true)
+    {
+        int tid = takeReady();
+        if (tid != NO_THREAD)
+        {
+            return tid;
+        }
+        if (table.state[MAIN_THREAD_ID] == Thread::READY)
+        {
+            return MAIN_THREAD_ID;
+        }
+        if (numOfFdWaiters == 0 && wakeups.isEmpty() && !hasOtherKernelThreads())
+        {
+            // Even the main thread is blocked or waits for a mutex, and nothing is left that
+            // could wake a thread: no descriptor to wait for, and no kernel thread to post.
+            std::cerr << TLERROR_DEADLOCK;
+            exit(EXIT_FAILURE);
+        }
+        // Even the main thread waits for a file descriptor, so sleep until a descriptor or a
+        // posted resume lets some thread run (resumes posted since the drain are taken first):
+        if (wakeups.isEmpty())
+        {
+            pollFds(true);
+        }
+        drainWakeups();
+    }
+}
+
+int Scheduler::takeReady()
+{
+    // Released deadline threads come first, earliest deadline first:
+    while (!deadlines.empty())
+    {
+        auto next = deadlines.front();
+        std::pop_heap(deadlines.begin(), deadlines.end(),
+                      std::greater<std::pair<long long, int>>());
+        deadlines.pop_back();
+        int tid = next.second;
+        if (isCurrentDeadline(next))
+        {
+            return tid;
+        }
+        // Skip entries of old releases and of threads that are no longer ready.
+    }
+
+    // Then the head with the lowest aging key, which is just the earliest queued without aging:
+    ReadyRing *best = nullptr;
+    long long bestKey = 0;
+    for (size_t priority = 0; priority < ready.size(); ++priority)
+    {
+        ReadyRing &queue = ready[priority];
+        while (!queue.isEmpty() && (table.state[queue.front().tid] != Thread::READY ||
+                                    isReleased(queue.front().tid)))
+        {
+            // Skip all the threads that are terminated, blocked, or waiting in the deadline heap.
+            queuedAt[queue.front().tid] = NOT_QUEUED;
+            queue.popFront();
+        }
+        if (queue.isEmpty())
+        {
+            continue;
+        }
+        long long key = queue.front().quantum + (long long) priority * agingQuanta;
+        if (best == nullptr || key < bestKey ||
+            (key == bestKey && queue.front().order < best->front().order))
+        {
+            best = &queue;
+            bestKey = key;
+        }
+    }
+    if (best == nullptr)
+    {
+        return NO_THREAD;
+    }
+    int tid = best->front().tid;
+    best->popFront();
+    queuedAt[tid] = NOT_QUEUED;
+    return tid;
+}
+
+bool Scheduler::hasOtherReady()
+{
+    if (!deadlines.empty() || !wakeups.isEmpty() || numOfFdWaiters > 0)
+    {
+        return true;
+    }
+    for (const auto &queue : ready)
+    {
+        if (!queue.isEmpty())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::isCurrentDeadline(const std::pair<long long, int> &entry)
+{
+    int tid = entry.second;
+    return threads[tid] != nullptr && table.state[tid] == Thread::READY && isReleased(tid) &&
+           threads[tid]->getDeadline().absolute == entry.first;
+}
+
+void Scheduler::removeFromReady(int tid)
+{
+    if (queuedAt[tid] != NOT_QUEUED)
+    {
+        ready[queuedAt[tid]].remove(tid);
+        queuedAt[tid] = NOT_QUEUED;
+    }
+}
+
+int Scheduler::setAging(int quanta)
+{
+    if (quanta < 0)
+    {
+        std::cerr << TLERROR_AGING_NEGATIVE;
+        return FAILURE;
+    }
+    agingQuanta = quanta;
+    return SUCCESS;
+}
+
+void Scheduler::switchTo(std::shared_ptr<Thread> &&previous)
+{
+    dispatcher.countQuantum();
+    ++table.totalQuantum[running->getId()];
+    setTimer(running->getId());
+    publish(running->getId());
+    dispatcher.switchToThread(std::move(previous), running);
+}
+
+bool Scheduler::isReleased(int tid)
+{
+    const Thread::Deadline &deadline = threads[tid]->getDeadline();
+    return deadline.relative > 0 && !deadline.throttled;
+}
+
+void Scheduler::release(int tid)
+{
+    Thread::Deadline &deadline = threads[tid]->getDeadline();
+    deadline.absolute = monotonicUsecs() + deadline.relative;
+    deadline.remaining = deadline.budget;
+    deadline.throttled = false;
+}
+
+long long Scheduler::usedOfSlice()
+{
+    return threadCpuUsecs() - sliceStart;
+}
+
+void Scheduler::chargeBudget()
+{
+    if (!isReleased(running->getId()))
+    {
+        return;
+    }
+    Thread::Deadline &deadline = running->getDeadline();
+    deadline.remaining -= usedOfSlice();
+    if (deadline.remaining <= 0)
+    {
+        // The budget ran out, so run in the normal classes until the next release.
+        deadline.throttled = true;
+    }
+}
+
+void Scheduler::enqueue(int tid)
+{
+    // Nothing here may allocate, since the timer's handler queues the thread it preempts.
+    removeFromReady(tid);
+    if (isReleased(tid))
+    {
+        if (deadlines.size() == deadlines.capacity())
+        {
+            // Drop the stale entries; a thread has only one current entry, so there is room then:
+            deadlines.erase(std::remove_if(deadlines.begin(), deadlines.end(),
+                                           [this](const std::pair<long long, int> &entry)
+                                           { return !isCurrentDeadline(entry); }),
+                            deadlines.end());
+            std::make_heap(deadlines.begin(), deadlines.end(),
+                           std::greater<std::pair<long long, int>>());
+        }
+        deadlines.emplace_back(threads[tid]->getDeadline().absolute, tid);
+        std::push_heap(deadlines.begin(), deadlines.end(),
+                       std::greater<std::pair<long long, int>>());
+    }
+    else
+    {
+        ready[table.priority[tid]].pushBack(
+                ReadyEntry{tid, dispatcher.getTotalQuantums(), enqueues++});
+        queuedAt[tid] = table.priority[tid];
+    }
+}
+
+void Scheduler::wakeThread(int tid)
+{
+    table.state[tid] = Thread::READY;
+    if (threads[tid]->getDeadline().relative > 0)
+    {
+        release(tid);
+    }
+    enqueue(tid);
+    publish(tid);
+}
+
+int Scheduler::setDeadline(int tid, int deadlineUsecs, int budgetUsecs)
+{
+    if (tid < 0 || tid >= MAX_THREAD_NUM || threads[tid] == nullptr || deadlineUsecs < 0 ||
+        (deadlineUsecs > 0 && budgetUsecs <= 0))
+    {
+        std::cerr << DEADLINE_ERR_MSG << tid << ".\n";
+        return FAILURE;
+    }
+    int runningId = running->getId();
+    if (tid == runningId)
+    {
+        // Settle the budget of the current release before changing it.
+        chargeBudget();
+    }
+    bool wasReleased = isReleased(tid);
+    Thread::Deadline &deadline = threads[tid]->getDeadline();
+    deadline.relative = deadlineUsecs;
+    deadline.budget = budgetUsecs;
+    if (table.state[tid] != Thread::READY)
+    {
+        // A blocked thread is released when it is resumed.
+        return SUCCESS;
+    }
+    if (deadlineUsecs > 0)
+    {
+        release(tid);
+    }
+    if (tid == runningId)
+    {
+        // Start a slice that fits the new budget, which was charged for the old slice:
+        setTimer(tid);
+        return SUCCESS;
+    }
+    if (deadlineUsecs == 0)
+    {
+        // A released thread's only entry is in the deadline heap, which now skips it:
+        if (wasReleased)
+        {
+            enqueue(tid);
+        }
+        return SUCCESS;
+    }
+
+    // Let the released thread run right away if its deadline is the earliest:
+    enqueue(tid);
+    if (!isReleased(runningId) || deadline.absolute < running->getDeadline().absolute)
+    {
+        preempt();
+    }
+    return SUCCESS;
+}
+
+int Scheduler::changePriority(int tid, int priority)
+{
+    if (threads[tid] == nullptr || !quantums.count(priority))
+    {
+        std::cerr << CHANGE_PRIORITY_ERR_MSG << tid << " to " << priority << ".\n";
+        return FAILURE;
+    }
+    threads[tid]->setBasePriority(priority);
+    threads[tid]->getAdaptation().quantum = baseQuantum(tid);
+    refreshPriority(tid);
+    return SUCCESS;
+}
+
+int Scheduler::terminate(int tid)
+{
+    if (threads[tid] == nullptr)
+    {
+        std::cerr << TERMINATION_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
+        return FAILURE;
+    }
+    if (tid == running->getId())
+    {
+        writeRequestedDump();
+    }
+    // Stop waiting for a mutex, and hand over the mutexes this thread holds:
+    int waitingOn = threads[tid]->getWaitingOn();
+    if (waitingOn != NO_MUTEX)
+    {
+        auto &waiters = mutexes[waitingOn]->waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), tid));
+        threads[tid]->setWaitingOn(NO_MUTEX);
+        refreshPriority(mutexes[waitingOn]->owner);
+    }
+    while (!threads[tid]->getHeldMutexes().empty())
+    {
+        releaseMutex(threads[tid]->getHeldMutexes().back());
+    }
+    cancelFdWait(tid);
+    // Free everything the thread allocated from its arena at once:
+    threads[tid]->getArena().release();
+
+    // Set the thread as terminated:
+    table.state[tid] = Thread::TERMINATED;
+    --numOfThreads;
+
+    if (tid == MAIN_THREAD_ID)
+    {
+    	// Main thread was terminated, so exit the program.
+        clearAndExit();
+    }
+    // Give the ID back to the heap of free IDs:
+    freeIds[numOfFreeIds++] = tid;
+    std::push_heap(freeIds, freeIds + numOfFreeIds, std::greater<int>());
+    if (running->getId() == tid)
+    {
+    	// Keep this thread as a zombie so that its stack is not freed while we are still on it.
+    	// It will be released by the next thread that terminates itself:
+        zombie = threads[tid];
+		// Running thread was terminated, so get the next thread, and only then publish the
+		// termination so that the snapshot never shows a terminated thread running:
+		auto previous = running;
+        running = threads[popNextReady()];
+        publish(tid);
+        // Release the pointer to this thread (or park it) and switch:
+        recycleThread(threads[tid]);
+        threads[tid].reset();
+        switchTo(std::move(previous));
+    }
+    publish(tid);
+    // Release the pointer to this thread (or park it in the pool):
+    recycleThread(threads[tid]);
+    threads[tid].reset();
+    return SUCCESS;
+}
+
+void Scheduler::clearAndExit()
+{
+	// Release all the pointers so resources are all freed:
+    running.reset();
+    zombie.reset();
+    ready.clear();
+    deadlines.clear();
+    pool.clear();
+    for (auto &thread : threads)
+    {
+        thread.reset();
+    }
+    for (auto &mutex : mutexes)
+    {
+        mutex.reset();
+    }
+    stopPreemption();
+    exit(EXIT_SUCCESS);
+}
+
+int Scheduler::block(int tid)
+{
+    if (tid == MAIN_THREAD_ID || threads[tid] == nullptr)
+    {
+    	// It's an error to block the main thread.
+        std::cerr << BLOCK_ERR_MSG << tid << '\n';
+        return FAILURE;
+    }
+    blockThread(tid);
+    return SUCCESS;
+}
+
+void Scheduler::blockThread(int tid)
+{
+    if (tid == running->getId())
+    {
+        writeRequestedDump();
+    }
+    // Set the state as blocked:
+    table.state[tid] = Thread::BLOCKED;
+    if (tid != running->getId())
+    {
+    	// Remove the entry of this thread from the ready queue:
+		removeFromReady(tid);
+        publish(tid);
+    }
+    else
+    {
+    	// Get the next thread and preform the context switch, publishing the block once the
+    	// thread is no longer running:
+        endRun(false);
+        auto previous = running;
+        running = threads[popNextReady()];
+        publish(tid);
+        switchTo(std::move(previous));
+    }
+}
+
+int Scheduler::resume(int tid)
+{
+    if (threads[tid] == nullptr)
+    {
+        std::cerr << RESUME_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
+        return FAILURE;
+    }
+    if (table.state[tid] == Thread::BLOCKED && threads[tid]->getWaitingOn() == NO_MUTEX &&
+        threads[tid]->getWaitingFd() == NO_FD)
+    {
+    	// If the thread was indeed blocked, add it back to the queue:
+        wakeThread(tid);
+
+        // A released deadline thread runs right away if its deadline is the earliest:
+        if (isReleased(tid) && (!isReleased(running->getId()) ||
+                                threads[tid]->getDeadline().absolute <
+                                running->getDeadline().absolute))
+        {
+            preempt();
+        }
+    }
+    return SUCCESS;
+}
+
+void Scheduler::drainWakeups()
+{
+    if (wakeups.isEmpty())
+    {
+        return;
+    }
+    // The IDs are taken into a member, since a big MAX_THREAD_NUM would not fit a thread's stack:
+    int taken = wakeups.takeAll(woken);
+    for (int i = 0; i < taken; ++i)
+    {
+        int tid = woken[i];
+        if (threads[tid] != nullptr && table.state[tid] == Thread::BLOCKED &&
+            threads[tid]->getWaitingOn() == NO_MUTEX && threads[tid]->getWaitingFd() == NO_FD)
+        {
+            wakeThread(tid);
+        }
+    }
+}
+
+int Scheduler::waitFd(int fd, int events)
+{
+    if (fd < 0 || fd == wakeups.getDoorbell() || events == 0 ||
+        (events & ~(POLLIN | POLLOUT)) != 0)
+    {
+        std::cerr << WAIT_FD_ERR_MSG << fd << ".\n";
+        return FAILURE;
+    }
+    if ((size_t) fd < fdWaiters.size() && fdWaiters[fd] != NO_THREAD)
+    {
+        std::cerr << WAIT_FD_ERR_MSG << fd << ": Another thread is waiting for it.\n";
+        return FAILURE;
+    }
+    try
+    {
+        if ((size_t) fd >= fdWaiters.size())
+        {
+            fdWaiters.resize((size_t) fd + 1, NO_THREAD);
+        }
+    }
+    catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+    openEpoll();
+
+    // Arm the descriptor for a single event. It stays in the set, disarmed, after that, so the
+    // next wait for it only modifies it (the kernel drops it from the set once it is closed):
+    epoll_event event = {};
+    event.events = (uint32_t) events | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0 &&
+        (errno != ENOENT || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0))
+    {
+        std::cerr << WAIT_FD_ERR_MSG << fd << ": " << strerror(errno) << ".\n";
+        return FAILURE;
+    }
+
+    // Block until pollFds wakes us. Hold on to this thread, since the main thread may get back
+    // here after the library was shut down, when this instance is gone:
+    std::shared_ptr<Thread> self = running;
+    int tid = self->getId();
+    fdWaiters[fd] = tid;
+    ++numOfFdWaiters;
+    self->setWaitingFd(fd);
+    self->setReadyEvents(0);
+    blockThread(tid);
+    return self->getReadyEvents();
+}
+
+void Scheduler::openEpoll()
+{
+    if (epollFd >= 0)
+    {
+        return;
+    }
+    // The doorbell of the posted resumes is in the set, so that sleeping on it also ends for them:
+    epoll_event doorbell = {};
+    doorbell.events = EPOLLIN | EPOLLET;
+    doorbell.data.fd = wakeups.getDoorbell();
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, doorbell.data.fd, &doorbell) < 0)
+    {
+        std::cerr << SYS_ERROR_EPOLL;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void Scheduler::pollFds(bool sleep)
+{
+    if (numOfFdWaiters == 0 && !sleep)
+    {
+        return;
+    }
+    // No thread may have waited for a descriptor yet, but a posted resume can end the sleep:
+    openEpoll();
+    int count;
+    while ((count = epoll_wait(epollFd, fdEvents, MAX_FD_EVENTS, sleep ? -1 : 0)) < 0 &&
+           errno == EINTR)
+    {
+        // No thread yields while even the main thread sleeps here, so write a dump the signal
+        // may have requested now:
+        if (sleep)
+        {
+            writeRequestedDump();
+        }
+    }
+    if (count < 0)
+    {
+        std::cerr << SYS_ERROR_EPOLL;
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        // The doorbell only ends the sleep; the caller takes the posted resumes.
+        int fd = fdEvents[i].data.fd;
+        if (fd == wakeups.getDoorbell() || fdWaiters[fd] == NO_THREAD)
+        {
+            continue;
+        }
+        int tid = fdWaiters[fd];
+        fdWaiters[fd] = NO_THREAD;
+        --numOfFdWaiters;
+        threads[tid]->setWaitingFd(NO_FD);
+        threads[tid]->setReadyEvents((int) (fdEvents[i].events &
+                                            (POLLIN | POLLOUT | POLLERR | POLLHUP)));
+        wakeThread(tid);
+    }
+}
+
+void *Scheduler::arenaAllocate(size_t size, size_t alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        std::cerr << ARENA_ALIGNMENT_ERR_MSG << alignment << ".\n";
+        return nullptr;
+    }
+    // If the timer switches threads in the middle, this thread is still the running one when it
+    // gets back here:
+    void *memory = running->getArena().allocate(size, alignment);
+    if (memory == nullptr)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+void Scheduler::publish(int tid)
+{
+    int state = UTHREAD_UNUSED;
+    if (threads[tid] != nullptr && table.state[tid] != Thread::TERMINATED)
+    {
+        state = table.state[tid] == Thread::READY ? UTHREAD_READY : UTHREAD_BLOCKED;
+    }
+    uthread_snapshot &shared = snapshot.beginWrite();
+    uthread_thread_snapshot &entry = shared.threads[tid];
+    // Count the threads as they come and go, so the count always matches the entries:
+    shared.num_of_threads += (state != UTHREAD_UNUSED) - (entry.state != UTHREAD_UNUSED);
+    entry.state = state;
+    entry.priority = table.priority[tid];
+    entry.quantums = table.totalQuantum[tid];
+    shared.total_quantums = dispatcher.getTotalQuantums();
+    shared.running_tid = running->getId();
+    snapshot.endWrite();
+}
+
+void Scheduler::cancelFdWait(int tid)
+{
+    int fd = threads[tid]->getWaitingFd();
+    if (fd == NO_FD)
+    {
+        return;
+    }
+    fdWaiters[fd] = NO_THREAD;
+    --numOfFdWaiters;
+    threads[tid]->setWaitingFd(NO_FD);
+    // Disarm the descriptor in case it outlives the thread (it may be closed already):
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Scheduler::yield()
+{
+    writeRequestedDump();
+    endRun(false);
+    preempt();
+    return SUCCESS;
+}
+
+int Scheduler::getRunningId()
+{
+    return running->getId();
+}
+
+int Scheduler::getTotalQuantums()
+{
+    return dispatcher.getTotalQuantums();
+}
+
+int Scheduler::getThreadsQuantums(int tid)
+{
+    if (threads[tid] == nullptr)
+    {
+        std::cerr << QUANTUM_ERR_MSG << tid << NON_EXISTENT_THREAD_MSG;
+        return FAILURE;
+    }
+    return table.totalQuantum[tid];
+}
+
+int Scheduler::createMutex()
+{
+    for (int mid = 0; mid < MAX_MUTEX_NUM; ++mid)
+    {
+        if (mutexes[mid] == nullptr)
+        {
+            try
+            {
+                mutexes[mid] = std::unique_ptr<Mutex>(new Mutex{NO_THREAD, {}});
+            } catch (std::bad_alloc &e)
+            {
+                std::cerr << SYS_ERROR_MEMORY_ALLOC;
+                exit(EXIT_FAILURE);
+            }
+            return mid;
+        }
+    }
+    std::cerr << MUTEX_CREATE_ERR_MSG;
+    return FAILURE;
+}
+
+int Scheduler::destroyMutex(int mid)
+{
+    if (mid < 0 || mid >= MAX_MUTEX_NUM || mutexes[mid] == nullptr)
+    {
+        std::cerr << MUTEX_DESTROY_ERR_MSG << mid << NON_EXISTENT_MUTEX_MSG;
+        return FAILURE;
+    }
+    if (mutexes[mid]->owner != NO_THREAD)
+    {
+        std::cerr << MUTEX_DESTROY_ERR_MSG << mid << ": Mutex is locked.\n";
+        return FAILURE;
+    }
+    mutexes[mid].reset();
+    return SUCCESS;
+}
+
+int Scheduler::lockMutex(int mid)
+{
+    if (mid < 0 || mid >= MAX_MUTEX_NUM || mutexes[mid] == nullptr)
+    {
+        std::cerr << MUTEX_LOCK_ERR_MSG << mid << NON_EXISTENT_MUTEX_MSG;
+        return FAILURE;
+    }
+    int tid = running->getId();
+    Mutex &mutex = *mutexes[mid];
+    if (mutex.owner == tid)
+    {
+        std::cerr << MUTEX_LOCK_ERR_MSG << mid << ": Mutex is already held by the thread.\n";
+        return FAILURE;
+    }
+    try
+    {
+        if (mutex.owner == NO_THREAD)
+        {
+            // Uncontended, take the mutex right away:
+            mutex.owner = tid;
+            running->getHeldMutexes().push_back(mid);
+            return SUCCESS;
+        }
+
+        // Wait for the mutex, lending our priority to its owner:
+        mutex.waiters.push_back(tid);
+    } catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+    running->setWaitingOn(mid);
+    refreshPriority(mutex.owner);
+    blockThread(tid);
+    // The mutex was handed to us by its previous owner.
+    return SUCCESS;
+}
+
+int Scheduler::unlockMutex(int mid)
+{
+    if (mid < 0 || mid >= MAX_MUTEX_NUM || mutexes[mid] == nullptr)
+    {
+        std::cerr << MUTEX_UNLOCK_ERR_MSG << mid << NON_EXISTENT_MUTEX_MSG;
+        return FAILURE;
+    }
+    if (mutexes[mid]->owner != running->getId())
+    {
+        std::cerr << MUTEX_UNLOCK_ERR_MSG << mid << ": Mutex is not held by the thread.\n";
+        return FAILURE;
+    }
+    releaseMutex(mid);
+    return SUCCESS;
+}
+
+void Scheduler::releaseMutex(int mid)
+{
+    Mutex &mutex = *mutexes[mid];
+    auto &owner = threads[mutex.owner];
+
+    // Remove the mutex from the owner's list (usually the last one locked):
+    auto &held = owner->getHeldMutexes();
+    held.erase(std::find(held.rbegin(), held.rend(), mid).base() - 1);
+
+    if (mutex.waiters.empty())
+    {
+        mutex.owner = NO_THREAD;
+        if (table.priority[owner->getId()] != owner->getBasePriority())
+        {
+            refreshPriority(owner->getId());
+        }
+        return;
+    }
+
+    // Hand the mutex to the most urgent waiter, the earliest among equals:
+    auto next = mutex.waiters.begin();
+    for (auto it = mutex.waiters.begin(); it != mutex.waiters.end(); ++it)
+    {
+        if (table.priority[*it] < table.priority[*next])
+        {
+            next = it;
+        }
+    }
+    int nextId = *next;
+    mutex.waiters.erase(next);
+    mutex.owner = nextId;
+    try
+    {
+        threads[nextId]->getHeldMutexes().push_back(mid);
+    } catch (std::bad_alloc &e)
+    {
+        std::cerr << SYS_ERROR_MEMORY_ALLOC;
+        exit(EXIT_FAILURE);
+    }
+    threads[nextId]->setWaitingOn(NO_MUTEX);
+    refreshPriority(owner->getId());
+    refreshPriority(nextId);
+    wakeThread(nextId);
+}
+
+void Scheduler::refreshPriority(int tid)
+{
+    while (tid != NO_THREAD)
+    {
+        // The effective priority is the most urgent among our own and our waiters':
+        auto &thread = threads[tid];
+        int priority = thread->getBasePriority();
+        for (int mid : thread->getHeldMutexes())
+        {
+            for (int waiter : mutexes[mid]->waiters)
+            {
+                priority = std::min(priority, table.priority[waiter]);
+            }
+        }
+        if (priority == table.priority[tid])
+        {
+            return;
+        }
+        if (queuedAt[tid] != NOT_QUEUED)
+        {
+            // Move the thread's entry to the queue of its new priority, keeping when it was queued:
+            ready[priority].insert(ready[queuedAt[tid]].remove(tid));
+            queuedAt[tid] = priority;
+        }
+        table.priority[tid] = priority;
+        publish(tid);
+
+        // Propagate the change to the owner of the mutex this thread waits for:
+        int waitingOn = thread->getWaitingOn();
+        tid = waitingOn == NO_MUTEX ? NO_THREAD : mutexes[waitingOn]->owner;
     }
-    return threads[tid]->getTotalQuantum();
 }
 
 // Set the static pointer to null:
-Scheduler *Scheduler::me = nullptr;
\ No newline at end of file
+Scheduler *Scheduler::me = nullptr;
+ThreadTable Scheduler::table;
+std::shared_ptr<Thread> Scheduler::orphan;
+sigjmp_buf Scheduler::mainEnvironment;
+char Scheduler::signalStack[SIGNAL_STACK_SIZE];
+struct sigaction Scheduler::oldFaultSa;
+bool Scheduler::faultHandlerInstalled = false;
+WakeQueue Scheduler::wakeups;
+// Constant-initialized, so it is set before the snapshot's constructor stores to it:
+std::atomic<uthread_snapshot *> uthread_live_snapshot(nullptr);
+Snapshot Scheduler::snapshot;
+volatile sig_atomic_t Scheduler::dumpRequested = 0;
+Stack *Stack::growable = nullptr;
+size_t Stack::pageSize = 0;
\ No newline at end of file
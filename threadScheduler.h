@@ -6,6 +6,7 @@
 #define THREADS_THREADSCHEDULER_H
 
 #include "uthreads.h"
+#include "uthreadsInline.h"
 #include <map>
 #include <memory>
 #include <queue>
@@ -13,8 +14,28 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <climits>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <numeric>
+#include <vector>
 
 
 
@@ -25,9 +46,16 @@
 #define SYS_ERROR_SIGACTION "system error: sigaction failure.\n"
 #define SYS_ERROR_MEMORY_ALLOC "system error: Memory allocation failure.\n"
 #define SYS_ERROR_SETITIMER "system error: setitimer failure.\n"
+#define SYS_ERROR_SIGALTSTACK "system error: sigaltstack failure.\n"
+#define SYS_ERROR_EVENTFD "system error: eventfd failure.\n"
+#define SYS_ERROR_SCHED_SETAFFINITY "system error: sched_setaffinity failure.\n"
+#define SYS_ERROR_CLOCK_GETTIME "system error: clock_gettime failure.\n"
+#define SYS_ERROR_EPOLL "system error: epoll failure.\n"
 #define TLERROR_INIT_NEGATIVE_QUANTUM "thread library error: Cannot initialize library with negative quantum.\n"
 #define TLERROR_SPAWN_NEGATIVE_PRIORITY "thread library error: Cannot spawn thread with negative priority.\n"
 #define TLERROR_INIT_NO_QUANTUMS "thread library error: Cannot initialize library with no quantum values.\n"
+#define TLERROR_INIT_ALREADY_INITIALIZED "thread library error: Library is already initialized.\n"
+#define TLERROR_SHUTDOWN_NOT_INITIALIZED "thread library error: Cannot shut down library that is not initialized.\n"
 #define BLOCK_ERR_MSG "thread library error: Cannot block thread with id "
 #define RESUME_ERR_MSG "thread library error: Cannot resume thread with id "
 #define NON_EXISTENT_THREAD_MSG ": No such thread.\n"
@@ -35,11 +63,192 @@
 #define TERMINATION_ERR_MSG "thread library error: Cannot terminate thread with id "
 #define CHANGE_PRIORITY_ERR_MSG "thread library error: Cannot change priority of thread with id "
 #define ADD_THREAD_ERR_MSG "thread library error: Cannot create new thread with priority "
+#define MUTEX_CREATE_ERR_MSG "thread library error: Cannot create new mutex: Too many mutexes.\n"
+#define MUTEX_DESTROY_ERR_MSG "thread library error: Cannot destroy mutex with id "
+#define MUTEX_LOCK_ERR_MSG "thread library error: Cannot lock mutex with id "
+#define MUTEX_UNLOCK_ERR_MSG "thread library error: Cannot unlock mutex with id "
+#define NON_EXISTENT_MUTEX_MSG ": No such mutex.\n"
+#define DEADLINE_ERR_MSG "thread library error: Cannot set deadline of thread with id "
+#define POST_RESUME_ERR_MSG "thread library error: Cannot post resume of a thread with an invalid id.\n"
+#define STATS_ERR_MSG "thread library error: Cannot get statistics of thread with id "
+#define TLERROR_ADAPTIVE_BOUNDS "thread library error: Cannot adapt quantums within these bounds.\n"
+#define DUMP_FD_ERR_MSG "thread library error: Cannot dump threads to file descriptor "
+#define DUMP_SIGNAL_ERR_MSG "thread library error: Cannot dump threads on signal "
+#define TLERROR_DEADLOCK "thread library error: Deadlock: No thread can run or be woken.\n"
+#define TLERROR_AGING_NEGATIVE "thread library error: Cannot age threads by a negative number of quantums.\n"
+#define AFFINITY_ERR_MSG "thread library error: Cannot pin threads to cpu "
+#define TLERROR_POOL_NEGATIVE_CAPACITY "thread library error: Cannot set a negative thread pool capacity.\n"
+#define TLERROR_STACK_SIZES "thread library error: Cannot use growable stacks with these sizes.\n"
+#define ARENA_ALIGNMENT_ERR_MSG "thread library error: Cannot allocate from the arena with alignment "
+#define SNAPSHOT_SHARE_ERR_MSG "thread library error: Cannot share the snapshot as "
+#define SNAPSHOT_OPEN_ERR_MSG "thread library error: Cannot open the snapshot shared as "
+#define TLERROR_SNAPSHOT_TORN "thread library error: Cannot read a consistent snapshot.\n"
+#define TLERROR_SNAPSHOT_CLOSE "thread library error: Cannot close a snapshot that is not open.\n"
+#define WAIT_FD_ERR_MSG "thread library error: Cannot wait for file descriptor "
 
 
 
+#define CACHE_LINE_SIZE 64 /* bytes */
+#define SIGNAL_STACK_SIZE 65536 /* bytes */
+#define STACK_FAULT_MARGIN 16384 /* bytes kept free below the stack pointer for signal frames */
+#define MAX_DUMP_FRAMES 32 /* deepest backtrace printed by a dump */
+#define RAW_DUMP_LINE_SIZE 256 /* bytes of a line of a dump written in a signal handler */
+#define MAX_FD_EVENTS 64 /* ready file descriptors taken per poll */
+#define MAX_SNAPSHOT_ATTEMPTS 10000 /* reads of a snapshot that is being updated before giving up */
+#define ARENA_CHUNK_SIZE 65536 /* bytes of the first chunk of an arena */
+#define ARENA_MAX_CHUNK_SIZE (1 << 22) /* bytes up to which arena chunks keep doubling */
+
+/*
+ * Stack of a user thread. A fixed stack is a page-aligned heap block of STACK_SIZE bytes. A
+ * growable stack reserves its maximal size, plus a guard page below it, without committing any
+ * memory, and makes only its top pages accessible. Faults on the rest of the reservation are
+ * resolved by the scheduler's SIGSEGV handler, which commits more pages.
+ */
+class Stack
+{
+public:
+	/**
+	 * Allocate a stack.
+	 * @param initialSize Bytes a growable stack starts with, or 0 for a fixed stack.
+	 * @param maxSize Bytes a growable stack may grow to.
+	 */
+	Stack(size_t initialSize, size_t maxSize);
+
+	/**
+	 * Destructor for a stack. Unmaps a growable stack.
+	 */
+	~Stack();
+
+	Stack(const Stack &) = delete;
+	Stack &operator=(const Stack &) = delete;
+
+	/**
+	 * Getter for the address just above the top of this stack.
+	 */
+	char *getTop() const;
+
+	/**
+	 * Getter for the lowest accessible address of this stack.
+	 */
+	char *getBottom() const;
+
+	/**
+	 * Make the pages of this growable stack accessible down to address, and at least double its
+	 * accessible part. Async-signal-safe.
+	 * @param address Lowest address that should be accessible. Addresses below the reservation
+	 * or in the guard page grow the stack to its maximal size.
+	 * @return true if the stack grew, false if it is fixed or already at its maximal size.
+	 */
+	bool grow(char *address);
+
+	/**
+	 * Give the pages a growable stack grew by back to the system, e.g. before it is reused.
+	 */
+	void shrink();
+
+	/**
+	 * Shrink this stack, give its accessible pages back to the system and fault them in again, so
+	 * they come from the memory node of the cpu the process runs on. The contents are lost, so
+	 * the stack must not be in use.
+	 */
+	void refault();
+
+	/**
+	 * Find the growable stack whose reservation contains address. Async-signal-safe.
+	 * @return The stack, or nullptr if there is none.
+	 */
+	static Stack *find(const char *address);
+
+private:
+	char *base;
+	char *committed;
+	size_t size;
+	size_t initialSize;
+	Stack *prev;
+	Stack *next;
+
+	/*
+	 * All the growable stacks, linked so that the SIGSEGV handler can search them at any point.
+	 */
+	static Stack *growable;
+
+	static size_t pageSize;
+};
+
+/*
+ * Bump allocator for the memory a user thread keeps until it terminates. Chunks are mapped
+ * directly, so allocating never takes malloc's lock, and each chunk is twice the size of the
+ * previous one. Nothing is freed before the whole arena is released.
+ */
+class Arena
+{
+public:
+	/**
+	 * Constructor for an empty arena. No memory is mapped before the first allocation.
+	 */
+	Arena();
+
+	/**
+	 * Destructor for an arena. Unmaps all its chunks.
+	 */
+	~Arena();
+
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	/**
+	 * Allocate memory from this arena.
+	 * @param size Number of bytes.
+	 * @param alignment Alignment of the memory, a power of two.
+	 * @return The memory, or nullptr if no chunk could be mapped for it.
+	 */
+	void *allocate(size_t size, size_t alignment);
+
+	/**
+	 * Free everything allocated from this arena. The first chunk is kept for the allocations
+	 * that come next, and the others are unmapped.
+	 */
+	void release();
+
+	/**
+	 * Getter for the number of bytes mapped for this arena.
+	 */
+	size_t getSize() const;
+
+private:
+	/*
+	 * Header at the start of every chunk.
+	 */
+	struct Chunk
+	{
+		/*
+		 * The chunk mapped before this one, or nullptr.
+		 */
+		Chunk *previous;
+
+		/*
+		 * Bytes mapped for this chunk, header included.
+		 */
+		size_t size;
+	};
+
+	Chunk *newest;
+	char *current;
+	char *end;
+	size_t size;
+
+	/**
+	 * Map a chunk big enough for an allocation and allocate from it.
+	 * @param size Number of bytes.
+	 * @param alignment Alignment of the memory, a power of two.
+	 * @return The memory, or nullptr if the chunk could not be mapped.
+	 */
+	void *allocateChunk(size_t size, size_t alignment);
+};
+
 /*
- * Class representing a user thread.
+ * Class representing a user thread. Only the fields that are cold on the scheduling path are kept
+ * here; the state, priority and quantum count live in the scheduler's ThreadTable.
  */
 class Thread
 {
@@ -47,7 +256,7 @@ public:
 	/*
 	 * enum representing states the thread can be in (READY includes RUNNING).
 	 */
-	enum states
+	enum states : unsigned char
 	{
 		READY,
 		BLOCKED,
@@ -59,15 +268,77 @@ public:
 	 */
 	typedef void (*EntryPoint_t)();
 
+	/*
+	 * Parameters and current release of a thread in the deadline scheduling class.
+	 */
+	struct Deadline
+	{
+		/*
+		 * Relative deadline in microseconds, or 0 if the thread is in the normal classes.
+		 */
+		int relative;
+
+		/*
+		 * Runtime budget per release, in microseconds of cpu time.
+		 */
+		int budget;
+
+		/*
+		 * Budget left in the current release.
+		 */
+		long long remaining;
+
+		/*
+		 * Absolute deadline of the current release, in microseconds of monotonic time.
+		 */
+		long long absolute;
+
+		/*
+		 * Whether the thread used up its budget and runs in the normal classes until its
+		 * next release.
+		 */
+		bool throttled;
+	};
+
+	/*
+	 * Recent behaviour of a thread and the quantum the adaptive mode chose for it.
+	 */
+	struct Adaptation
+	{
+		/*
+		 * Length of this thread's quantum in microseconds, when quantums are adaptive.
+		 */
+		long long quantum;
+
+		/*
+		 * Moving average of the virtual time this thread ran before switching, in microseconds.
+		 */
+		long long averageRun;
+
+		/*
+		 * Moving average of the share of runs that ended before the quantum expired, per mille.
+		 */
+		int earlyEnds;
+
+		/*
+		 * Number of times the quantum was lengthened and shortened.
+		 */
+		int grown;
+		int shrunk;
+	};
+
 
 	/**
 	 * contructor for a thread.
 	 * @param id ID of this thread.
-	 * @param priority Priority this thread should start with.
+	 * @param priority Own priority this thread should start with.
 	 * @param entry Entry point of this thread.
 	 * @param mainThread
+	 * @param initialStackSize Bytes a growable stack starts with, or 0 for a fixed stack.
+	 * @param maxStackSize Bytes a growable stack may grow to.
 	 */
-	Thread(int id, int priority, EntryPoint_t entry, bool mainThread = false);
+	Thread(int id, int priority, EntryPoint_t entry, bool mainThread = false,
+		   size_t initialStackSize = 0, size_t maxStackSize = 0);
 
 	/**
 	 * Getter for this thread's environment.
@@ -80,45 +351,335 @@ public:
 	int getId() const;
 
 	/**
-	 * Getter for this thread's priority value.
+	 * Getter for this thread's own priority, as given at spawn or by changePriority.
 	 */
-	int getPriority() const;
+	int getBasePriority() const;
 
 	/**
-	 * Setter for this thread's priority.
+	 * Setter for this thread's own priority.
 	 * @param _priority New priority value to give this thread.
 	 */
-	void setPriority(int _priority);
+	void setBasePriority(int _priority);
 
 	/**
-	 * Getter for this thread's current state.
-	 * @return
+	 * Getter for the ID of the mutex this thread is waiting for (NO_MUTEX if none).
+	 */
+	int getWaitingOn() const;
+
+	/**
+	 * Setter for the ID of the mutex this thread is waiting for.
+	 * @param mid ID of the mutex, or NO_MUTEX.
+	 */
+	void setWaitingOn(int mid);
+
+	/**
+	 * Getter for the file descriptor this thread is waiting for (NO_FD if none).
+	 */
+	int getWaitingFd() const;
+
+	/**
+	 * Setter for the file descriptor this thread is waiting for.
+	 * @param fd The file descriptor, or NO_FD.
+	 */
+	void setWaitingFd(int fd);
+
+	/**
+	 * Getter for the events the file descriptor this thread waited for became ready for.
+	 */
+	int getReadyEvents() const;
+
+	/**
+	 * Setter for the events the file descriptor this thread waited for became ready for.
+	 * @param events Mask of poll events.
+	 */
+	void setReadyEvents(int events);
+
+	/**
+	 * Getter for the IDs of the mutexes this thread currently holds, in locking order.
+	 */
+	std::vector<int> &getHeldMutexes();
+
+	/**
+	 * Getter for this thread's deadline class parameters.
+	 */
+	Deadline &getDeadline();
+
+	/**
+	 * Getter for this thread's adaptive quantum state.
+	 */
+	Adaptation &getAdaptation();
+
+	/**
+	 * Getter for this thread's stack, or nullptr for the main thread, which runs on the
+	 * process's stack.
 	 */
-	states getState() const;
+	const Stack *getStack() const;
 
 	/**
-	 * Setter for this threa'd current state.
-	 * @param _state The new state for this thread.
+	 * Getter for this thread's arena.
 	 */
-	void setState(states _state);
+	Arena &getArena();
 
 	/**
-	 * Increment the total quantum count for this thread.
+	 * Getter for this thread's entry point, or nullptr for the main thread.
 	 */
-	void incrementTotalQuantum();
+	EntryPoint_t getEntry() const;
 
 	/**
-	 * Getter for the total quantum count of this thread.
+	 * Re-initialize a parked thread so it can be reused for a new spawn. The stack is kept (a
+	 * growable one shrunk back to its initial size) and the environment is rewritten in place,
+	 * so no allocation or sigsetjmp takes place.
+	 * @param _id ID the thread should be reused with.
+	 * @param _priority Own priority the thread should start with.
+	 * @param entry Entry point of the thread.
 	 */
-	int getTotalQuantum() const;
+	void reset(int _id, int _priority, EntryPoint_t entry);
+
+	/**
+	 * Fault the stack of this parked thread in again from the cpu the process runs on.
+	 */
+	void refaultStack();
 
 private:
 	int id;
-	int totalQuantum;
-	int priority;
-	states state;
+	int basePriority;
+	int waitingOn;
+	int waitingFd;
+	int readyEvents;
+	EntryPoint_t entry;
 	sigjmp_buf environment;
-	std::unique_ptr<char[]> stack;
+	std::unique_ptr<Stack> stack;
+	Arena arena;
+	std::vector<int> heldMutexes;
+	Deadline deadline;
+	Adaptation adaptation;
+
+	/**
+	 * Point the environment at the top of this thread's stack and at Scheduler::startThread, with
+	 * only SIGVTALRM masked, and keep entry for it to call.
+	 * @param _entry Entry point of the thread.
+	 */
+	void setupEnvironment(EntryPoint_t _entry);
+};
+
+/*
+ * Scheduling fields of all threads, indexed by thread ID. They are kept apart from the threads'
+ * environments and stacks so that scanning them touches only a few dense cache lines.
+ */
+struct ThreadTable
+{
+	/*
+	 * Current state of each thread.
+	 */
+	alignas(CACHE_LINE_SIZE) Thread::states state[MAX_THREAD_NUM];
+
+	/*
+	 * Effective priority of each thread (its own priority, possibly boosted by threads waiting
+	 * for mutexes it holds).
+	 */
+	alignas(CACHE_LINE_SIZE) int priority[MAX_THREAD_NUM];
+
+	/*
+	 * Number of quantums each thread has started.
+	 */
+	alignas(CACHE_LINE_SIZE) int totalQuantum[MAX_THREAD_NUM];
+};
+
+/*
+ * Entry of a ready queue: a thread and when it was queued.
+ */
+struct ReadyEntry
+{
+	/*
+	 * ID of the queued thread.
+	 */
+	int tid;
+
+	/*
+	 * Total quantum count when the thread was queued.
+	 */
+	int quantum;
+
+	/*
+	 * Number of threads queued before this one, in all the queues.
+	 */
+	long long order;
+};
+
+/*
+ * Ready queue of one priority: a ring with room for an entry of every thread, so that queueing
+ * never allocates (the timer's signal handler queues threads). A thread has at most one entry.
+ */
+class ReadyRing
+{
+public:
+	/**
+	 * Constructor for an empty ready queue. Allocates the ring.
+	 */
+	ReadyRing();
+
+	/**
+	 * Whether the queue is empty.
+	 */
+	bool isEmpty() const;
+
+	/**
+	 * Getter for the entry at the front of the queue, which must not be empty.
+	 */
+	const ReadyEntry &front() const;
+
+	/**
+	 * Add an entry at the back of the queue.
+	 * @param entry The entry, of a thread that has no entry in the queue.
+	 */
+	void pushBack(const ReadyEntry &entry);
+
+	/**
+	 * Remove the entry at the front of the queue, which must not be empty.
+	 */
+	void popFront();
+
+	/**
+	 * Remove the entry of a thread, keeping the others in order.
+	 * @param tid ID of the thread.
+	 * @return The entry that was removed.
+	 */
+	ReadyEntry remove(int tid);
+
+	/**
+	 * Insert an entry among the others by its order, as if it had been queued here.
+	 * @param entry The entry, of a thread that has no entry in the queue.
+	 */
+	void insert(const ReadyEntry &entry);
+
+private:
+	std::unique_ptr<ReadyEntry[]> entries;
+	int head;
+	int size;
+
+	/**
+	 * Getter for the entry at position i from the front.
+	 */
+	ReadyEntry &at(int i);
+};
+
+/*
+ * A mutex with priority inheritance: while threads wait for it, its owner runs with the most
+ * urgent (numerically lowest) priority among itself and its waiters.
+ */
+struct Mutex
+{
+	/*
+	 * ID of the thread holding this mutex, or NO_THREAD if it is unlocked.
+	 */
+	int owner;
+
+	/*
+	 * IDs of the threads waiting for this mutex, in arrival order.
+	 */
+	std::vector<int> waiters;
+};
+
+/*
+ * Lock-free queue of resume requests posted from outside the scheduler: by other kernel threads
+ * or by signal handlers. A thread ID is queued at most once at a time. Posting pushes it on a
+ * Treiber stack, the scheduler takes the whole stack at once, and an eventfd doorbell becomes
+ * readable whenever requests were posted to an empty queue.
+ */
+class WakeQueue
+{
+public:
+	/**
+	 * Constructor for an empty wake queue. Creates the doorbell.
+	 */
+	WakeQueue();
+
+	WakeQueue(const WakeQueue &) = delete;
+	WakeQueue &operator=(const WakeQueue &) = delete;
+
+	/**
+	 * Queue a resume request for the thread with ID tid, unless one is already queued.
+	 * Async-signal-safe and safe to call from any kernel thread.
+	 * @param tid ID of the thread, in [0, MAX_THREAD_NUM).
+	 */
+	void post(int tid);
+
+	/**
+	 * Take all the queued requests and clear the doorbell. To be called by the scheduler only.
+	 * @param tids Filled with the IDs of the threads to resume, in posting order.
+	 * @return Number of IDs taken.
+	 */
+	int takeAll(int tids[MAX_THREAD_NUM]);
+
+	/**
+	 * Whether there are queued requests.
+	 */
+	bool isEmpty() const;
+
+	/**
+	 * Getter for the doorbell's file descriptor.
+	 */
+	int getDoorbell() const;
+
+private:
+	std::atomic<int> head;
+	std::atomic<int> next[MAX_THREAD_NUM];
+	std::atomic<bool> queued[MAX_THREAD_NUM];
+	int doorbell;
+};
+
+/*
+ * The snapshot of the threads and counters that monitors read, behind a sequence lock: the
+ * scheduler makes the sequence odd, updates the snapshot and makes it even again, and a reader
+ * copies the snapshot between two reads of the same even sequence. Only the scheduler's kernel
+ * thread writes, with the timer signal blocked, so updates never overlap. uthread_live_snapshot
+ * points to where the snapshot is, for the inline functions.
+ */
+class Snapshot
+{
+public:
+	/**
+	 * Constructor for an empty snapshot, kept in this object until it is shared. There is one.
+	 */
+	Snapshot();
+
+	Snapshot(const Snapshot &) = delete;
+	Snapshot &operator=(const Snapshot &) = delete;
+
+	/**
+	 * Start an update: make the sequence odd.
+	 * @return The snapshot to update.
+	 */
+	uthread_snapshot &beginWrite();
+
+	/**
+	 * End the update started by beginWrite: make the sequence even.
+	 */
+	void endWrite();
+
+	/**
+	 * Mark all threads unused and the library not initialized.
+	 */
+	void clear();
+
+	/**
+	 * Move the snapshot to a shared memory object, or unlink the object it was moved to.
+	 * @param name Name of the object, or nullptr to unlink it.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int share(const char *name);
+
+	/**
+	 * Copy a consistent snapshot. Safe to call from any kernel thread.
+	 * @param source Snapshot to read, or nullptr for this one.
+	 * @param copy Filled with the snapshot.
+	 * @return 0 on success, -1 if no consistent copy was made after MAX_SNAPSHOT_ATTEMPTS.
+	 */
+	int read(const uthread_snapshot *source, uthread_snapshot *copy) const;
+
+private:
+	uthread_snapshot local;
+	char sharedName[NAME_MAX + 1];
 };
 
 /*
@@ -132,6 +693,11 @@ public:
 	 */
 	Dispatcher();
 
+	/**
+	 * Count a new quantum, before switching to the thread that starts it.
+	 */
+	void countQuantum();
+
 	/**
 	 * Preform a context switch from the current thread to the target thread.
 	 * @param currentThread Current (running) thread.
@@ -150,7 +716,8 @@ private:
 
 /*
  * Singleton Scheduler object responsible for implementing the uthread library functionality.
- * Only one instance of this object can be used at once.
+ * Only one instance of this object can exist at once; a new one may be created after the previous
+ * one was destroyed.
  */
 class Scheduler
 {
@@ -159,18 +726,90 @@ class Scheduler
 	 */
 	static Scheduler *me;
 
+	/*
+	 * Scheduling fields of the threads of the singleton instance.
+	 */
+	static ThreadTable table;
+
+	/*
+	 * Thread that shut the previous instance down, kept alive until the next instance is
+	 * created since it was still running on its own stack.
+	 */
+	static std::shared_ptr<Thread> orphan;
+
+	/*
+	 * Environment of the main thread of the previous instance, to get back to after shutdown.
+	 */
+	static sigjmp_buf mainEnvironment;
+
+	/*
+	 * Alternate signal stack the SIGSEGV handler runs on, since the faulting stack has no room.
+	 */
+	static char signalStack[SIGNAL_STACK_SIZE];
+
+	/*
+	 * SIGSEGV action from before the handler was installed, for faults that are not on a
+	 * growable stack. The handler stays installed once a growable stack is used.
+	 */
+	static struct sigaction oldFaultSa;
+
+	static bool faultHandlerInstalled;
+
+	/*
+	 * Set by the dump signal's handler; the dump is written when a thread next yields, blocks or
+	 * terminates itself, when the sleep for a descriptor is interrupted, or, with addresses only,
+	 * when the timer's handler next runs.
+	 */
+	static volatile sig_atomic_t dumpRequested;
+
 public:
+	/*
+	 * Resume requests posted from other kernel threads and signal handlers. It outlives the
+	 * instances, so posting is safe even while the library is being shut down.
+	 */
+	static WakeQueue wakeups;
+
+	/*
+	 * Snapshot of the threads for monitors. It outlives the instances, like wakeups.
+	 */
+	static Snapshot snapshot;
 
-	class SchedulerException: std::exception
-	{};
 
 	/**
-	 * Constructor for scheduler. Call only once. Further calls will raise SchedulerException.
+	 * Constructor for scheduler. Do not create an instance while another one exists.
 	 * @param pQuantums mapping between priorities and amount of milliseconds the quantum should
 	 * run for.
 	 */
 	explicit Scheduler(const std::map<int, int> &pQuantums);
 
+	/**
+	 * Destructor for scheduler. Stops preemption, restores the previous SIGVTALRM action and
+	 * releases all threads, stacks and mutexes.
+	 */
+	~Scheduler();
+
+	/**
+	 * Prepare the scheduler for destruction. If the running thread is not the main thread, it
+	 * is kept alive (as the orphan) so that the caller can keep running on its stack until
+	 * it calls resumeMain.
+	 * @return true if the caller must call resumeMain after destroying the scheduler.
+	 */
+	bool shutdown();
+
+	/**
+	 * Jump back to the main thread of a destroyed scheduler, where it last stopped running.
+	 * Does not return. The main thread may get back into a method that switched threads, so such
+	 * methods must not touch the instance once the switch returns.
+	 */
+	static void resumeMain();
+
+	/**
+	 * Code every new thread starts at. Threads are jumped to with the timer masked, so that a
+	 * pending SIGVTALRM cannot run the handler before the jump has left the previous thread's
+	 * stack; this unmasks it and calls the running thread's entry point.
+	 */
+	static void startThread();
+
 	/**
 	 * Create a new thread.
 	 * @param entryPoint Entry point for this thread.
@@ -209,6 +848,12 @@ public:
 	 */
 	int resume(int tid);
 
+	/**
+	 * Move the running thread to the back of its queue and make a scheduling decision.
+	 * @return 0 on success.
+	 */
+	int yield();
+
 	/**
 	 * Get the ID of the currently running thread.
 	 * @return
@@ -227,14 +872,181 @@ public:
 	 */
 	int getThreadsQuantums(int tid);
 
+	/**
+	 * Set the capacity of the pool of terminated threads kept for reuse. Terminated threads are
+	 * parked in the pool (up to capacity) instead of being freed, and new threads are taken
+	 * from it when possible. The pool is filled up to capacity right away. A capacity of 0
+	 * (the default) disables pooling.
+	 * @param capacity Maximal number of parked threads.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setPoolCapacity(int capacity);
+
+	/**
+	 * Pin the kernel thread running all the threads to a cpu. The stacks of parked threads are
+	 * faulted in again after pinning, so stacks taken from the pool are local to that cpu's
+	 * memory node.
+	 * @param cpu The cpu to run on.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setAffinity(int cpu);
+
+	/**
+	 * Make threads spawned from now on use growable stacks, or fixed stacks of STACK_SIZE bytes.
+	 * Parked threads are reallocated with the new kind of stack.
+	 * @param initialSize Bytes a growable stack starts with, or 0 for fixed stacks.
+	 * @param maxSize Bytes a growable stack may grow to, or 0 for fixed stacks.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setGrowableStacks(int initialSize, int maxSize);
+
+	/**
+	 * Let each thread's quantum adapt to how it behaves, within bounds, or go back to the fixed
+	 * quantums of the priorities. A thread whose quantum expires gets one twice as long; a thread
+	 * that mostly gives up the cpu early gets one twice its recent average run.
+	 * @param minUsecs Shortest quantum in microseconds, or 0 to disable adaptation.
+	 * @param maxUsecs Longest quantum in microseconds, or 0 to disable adaptation.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setAdaptiveQuantum(int minUsecs, int maxUsecs);
+
+	/**
+	 * Get the scheduling statistics of the thread with ID tid.
+	 * @param tid ID of the thread.
+	 * @param stats Filled with the statistics.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int getStats(int tid, uthread_stats *stats);
+
+	/**
+	 * Set how fast waiting threads age. Each priority has its own ready queue, and the next
+	 * thread is taken from the queue whose head has the lowest key: the quantum count when it
+	 * was queued, plus its priority times quanta (earliest queued among equal keys). A thread
+	 * of priority p thus waits at most p * quanta more quantums than a thread of priority 0
+	 * queued at the same time. With 0 (the default) all threads are served first come, first
+	 * served.
+	 * @param quanta Quantums of waiting that make up for one level of priority.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setAging(int quanta);
+
+	/**
+	 * Write the state, priority, quantum count and backtrace of every thread to fd.
+	 * Backtraces follow frame pointers, so they need code built with them.
+	 * @param fd File descriptor to write to.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int dump(int fd);
+
+	/**
+	 * Dump the threads to stderr once a thread yields, blocks or terminates itself, or a quantum
+	 * expires, after signum is received, or restore the previous action of the dump signal.
+	 * @param signum Signal to dump on, or 0 to stop.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setDumpSignal(int signum);
+
+	/**
+	 * Create a new mutex.
+	 * @return ID of the new mutex on success, -1 if failed.
+	 */
+	int createMutex();
+
+	/**
+	 * Destroy the mutex with ID mid. A mutex that is locked cannot be destroyed.
+	 * @param mid ID of the mutex.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int destroyMutex(int mid);
+
+	/**
+	 * Lock the mutex with ID mid for the running thread. If the mutex is held by another thread,
+	 * the owner (and, transitively, whatever it waits for) inherits the running thread's
+	 * priority and the running thread waits until the mutex is handed to it.
+	 * @param mid ID of the mutex.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int lockMutex(int mid);
+
+	/**
+	 * Unlock the mutex with ID mid, held by the running thread. The mutex is handed to its most
+	 * urgent waiter, and the running thread drops any priority it inherited through it.
+	 * @param mid ID of the mutex.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int unlockMutex(int mid);
+
+	/**
+	 * Move the thread with ID tid into the deadline class, or back to the normal classes.
+	 * Threads in the deadline class that have budget left run before all other threads, earliest
+	 * absolute deadline first. A thread is released (gets a new absolute deadline and a full
+	 * budget) now if it is ready, and whenever it is resumed. A thread that uses up its budget
+	 * is throttled to the normal classes until its next release.
+	 * @param tid ID of the thread.
+	 * @param deadlineUsecs Relative deadline in microseconds, or 0 to leave the deadline class.
+	 * @param budgetUsecs Runtime budget per release in microseconds.
+	 * @return 0 on success, -1 if failed.
+	 */
+	int setDeadline(int tid, int deadlineUsecs, int budgetUsecs);
+
+	/**
+	 * Block the running thread until the file descriptor fd is ready for events. The descriptor
+	 * is registered with the instance's epoll set, one-shot, and polled at every scheduling point.
+	 * @param fd The file descriptor.
+	 * @param events Mask of POLLIN and POLLOUT.
+	 * @return The events fd became ready for on success, -1 if failed.
+	 */
+	int waitFd(int fd, int events);
+
+	/**
+	 * Allocate memory from the running thread's arena. Only the running thread touches its
+	 * arena, so this is safe without blocking the timer signal.
+	 * @param size Number of bytes.
+	 * @param alignment Alignment of the memory, a power of two.
+	 * @return The memory on success, nullptr if failed.
+	 */
+	void *arenaAllocate(size_t size, size_t alignment);
+
 private:
 	std::shared_ptr<Thread> threads[MAX_THREAD_NUM];
 	size_t numOfThreads;
+	int freeIds[MAX_THREAD_NUM];
+	int numOfFreeIds;
+	std::vector<std::shared_ptr<Thread>> pool;
+	size_t poolCapacity;
+	size_t initialStackSize;
+	size_t maxStackSize;
+	long long minQuantum;
+	long long maxQuantum;
+	int dumpSignal;
+	char *mainStackBottom;
+	char *mainStackTop;
+	struct sigaction oldDumpSa = {{nullptr}};
+	std::unique_ptr<Mutex> mutexes[MAX_MUTEX_NUM];
 	std::map<int, itimerval> quantums;
 	std::shared_ptr<Thread> running;
-	std::deque<std::shared_ptr<Thread>> ready;
+	std::shared_ptr<Thread> zombie;
+	std::vector<ReadyRing> ready;
+	int queuedAt[MAX_THREAD_NUM];
+	long long enqueues;
+	long long agingQuanta;
+	std::vector<std::pair<long long, int>> deadlines;
+	int epollFd;
+	std::vector<int> fdWaiters;
+	int numOfFdWaiters;
+	epoll_event fdEvents[MAX_FD_EVENTS];
+	int woken[MAX_THREAD_NUM];
+	long long sliceUsecs;
+	long long sliceStart;
 	Dispatcher dispatcher;
 	struct sigaction sa = {{nullptr}};
+	struct sigaction oldSa = {{nullptr}};
+
+	/**
+	 * Disarm the timer and restore the SIGVTALRM action from before this instance was created,
+	 * discarding a pending SIGVTALRM.
+	 */
+	void stopPreemption();
 
 	/**
 	 * Release all resources and exit the program.
@@ -242,15 +1054,239 @@ private:
 	void clearAndExit();
 
 	/**
-	 * Handler function for SIGVTALRM. Called by sigaction only.
+	 * Handler function for SIGVTALRM. Called by sigaction only. Writes a requested dump before
+	 * preempting, so that threads that never yield are dumped too.
 	 */
-	static void timerHandler(int);
+	static void timerHandler(int, siginfo_t *, void *context);
 
 	/**
-	 * Set the timer for SIGVTALRM for a quantum corresponding to priority.
-	 * @param priority priority of the quantum the timer should be set for.
+	 * Handler function for SIGSEGV, run on the alternate signal stack. Grows the stack the fault
+	 * is on, or hands the fault to the previous action if it is not on a growable stack.
+	 */
+	static void faultHandler(int, siginfo_t *info, void *context);
+
+	/**
+	 * Install faultHandler and the alternate signal stack, unless already installed.
+	 */
+	static void installFaultHandler();
+
+	/**
+	 * Handler function for the dump signal. Only requests the dump.
+	 */
+	static void dumpSignalHandler(int);
+
+	/**
+	 * Write the dump requested by the dump signal to stderr, if there is one. Called where the
+	 * running thread yields, blocks or terminates itself, and where a signal interrupts the sleep
+	 * for a descriptor, outside any signal handler.
+	 */
+	void writeRequestedDump();
+
+	/**
+	 * Write the dump requested by the dump signal to stderr, if there is one, from the timer's
+	 * handler. Only async-signal-safe calls are made, so frames are given by address alone.
+	 * @param interrupted Context the running thread was interrupted in.
+	 */
+	void writeRequestedRawDump(const ucontext_t *interrupted);
+
+	/**
+	 * Write the state line and backtrace of the thread with ID tid to fd.
+	 * @param fd File descriptor to write to.
+	 * @param tid ID of the thread.
+	 */
+	void dumpThread(int fd, int tid);
+
+	/**
+	 * Write the state line and the addresses of the backtrace of the thread with ID tid to fd,
+	 * with write(2) only.
+	 * @param fd File descriptor to write to.
+	 * @param tid ID of the thread.
+	 * @param interrupted Context the running thread was interrupted in.
+	 */
+	void dumpRawThread(int fd, int tid, const ucontext_t *interrupted);
+
+	/**
+	 * Find the bounds of the process's stack, which the main thread runs on, unless already
+	 * found. Not async-signal-safe, so it is done before a dump can be written in a handler.
+	 */
+	void findMainStack();
+
+	/**
+	 * Set the timer for SIGVTALRM for the quantum of the thread with ID tid: the quantum
+	 * corresponding to its priority, cut short to its remaining budget if it is a released
+	 * deadline thread.
+	 * @param tid ID of the thread the timer should be set for.
+	 */
+	void setTimer(int tid);
+
+	/**
+	 * Put the running thread back in its queue and switch to the next thread.
+	 */
+	void preempt();
+
+	/**
+	 * Record how the running thread's run ended and adapt its quantum, if quantums are adaptive.
+	 * @param expired Whether its quantum expired, rather than it giving up the cpu.
+	 */
+	void endRun(bool expired);
+
+	/**
+	 * Get the fixed quantum of the thread with ID tid's own priority, clamped to the adaptive
+	 * bounds.
+	 * @param tid ID of the thread.
+	 */
+	long long baseQuantum(int tid);
+
+	/**
+	 * Whether the thread with ID tid is in the deadline class and has budget left in its
+	 * current release.
+	 * @param tid ID of the thread.
+	 */
+	bool isReleased(int tid);
+
+	/**
+	 * Give a deadline thread a new absolute deadline and a full budget.
+	 * @param tid ID of the thread.
+	 */
+	void release(int tid);
+
+	/**
+	 * Get the cpu time the running thread used of its current slice, in microseconds. Only
+	 * measured for released deadline threads, and for all threads when quantums are adaptive.
+	 */
+	long long usedOfSlice();
+
+	/**
+	 * Charge the running thread's deadline budget for the part of its quantum it used, and
+	 * throttle it if the budget ran out.
+	 */
+	void chargeBudget();
+
+	/**
+	 * Put a READY thread in the deadline heap if it is released, or at the back of the ready
+	 * queue of its effective priority otherwise.
+	 * @param tid ID of the thread.
+	 */
+	void enqueue(int tid);
+
+	/**
+	 * Move a blocked thread to the READY state, releasing it if it is a deadline thread.
+	 * @param tid ID of the thread.
+	 */
+	void wakeThread(int tid);
+
+	/**
+	 * Make a scheduling point and pop the next thread to run, as takeReady.
+	 * @return ID of the next thread, or the main thread's ID if the queues ran out. If the main
+	 * thread is blocked or waiting too, sleeps until some thread can run, or exits the program
+	 * with an error if nothing could ever wake one.
+	 */
+	int popNextReady();
+
+	/**
+	 * Pop the released deadline thread with the earliest deadline, or else the READY thread with
+	 * the lowest aging key among the heads of the ready queues. Stale entries are skipped.
+	 * @return ID of the thread, or NO_THREAD if the queues ran out.
+	 */
+	int takeReady();
+
+	/**
+	 * Whether a thread other than the running one may be ready to run: some thread is queued, or
+	 * there are posted resumes or file descriptors to check. Never false if there is one.
+	 */
+	bool hasOtherReady();
+
+	/**
+	 * Whether an entry of the deadline heap is for the current release of a READY thread.
+	 * @param entry Absolute deadline and ID of the thread.
+	 */
+	bool isCurrentDeadline(const std::pair<long long, int> &entry);
+
+	/**
+	 * Count a new quantum for the running thread, set its timer and switch to it.
+	 * @param previous The thread that was running until now.
+	 */
+	void switchTo(std::shared_ptr<Thread> &&previous);
+
+	/**
+	 * Get a thread for a new spawn, reusing a parked one if there is one that is no longer
+	 * referenced anywhere else.
+	 * @param id ID of the new thread.
+	 * @param priority Priority the new thread should start with.
+	 * @param entryPoint Entry point of the new thread.
+	 */
+	std::shared_ptr<Thread> createThread(int id, int priority, Thread::EntryPoint_t entryPoint);
+
+	/**
+	 * Allocate a new thread with the current kind of stack.
+	 * @param id ID of the new thread.
+	 * @param priority Priority the new thread should start with.
+	 * @param entryPoint Entry point of the new thread.
+	 */
+	std::shared_ptr<Thread> allocateThread(int id, int priority, Thread::EntryPoint_t entryPoint);
+
+	/**
+	 * Park a terminated thread in the pool if there is room for it.
+	 * @param thread The terminated thread.
+	 */
+	void recycleThread(const std::shared_ptr<Thread> &thread);
+
+	/**
+	 * Block the thread with ID tid and, if it is the running thread, switch to the next one.
+	 * @param tid ID of the thread to block.
+	 */
+	void blockThread(int tid);
+
+	/**
+	 * Remove the entry of the thread with ID tid from the ready queues, if it has one.
+	 * @param tid ID of the thread.
+	 */
+	void removeFromReady(int tid);
+
+	/**
+	 * Resume the threads of all the requests posted to wakeups. Requests for threads that do not
+	 * exist or are not blocked are dropped, as is the case with resume.
+	 */
+	void drainWakeups();
+
+	/**
+	 * Create the epoll set, with the wakeups' doorbell in it, unless it exists already.
+	 */
+	void openEpoll();
+
+	/**
+	 * Wake the threads whose file descriptors became ready.
+	 * @param sleep Whether to sleep until a descriptor or the wakeups' doorbell is ready, rather
+	 * than only take what is ready now.
+	 */
+	void pollFds(bool sleep);
+
+	/**
+	 * Update the snapshot's entry of the thread with ID tid, and the counters.
+	 * @param tid ID of the thread.
+	 */
+	void publish(int tid);
+
+	/**
+	 * Stop the thread with ID tid from waiting for its file descriptor, if it waits for one.
+	 * @param tid ID of the thread.
+	 */
+	void cancelFdWait(int tid);
+
+	/**
+	 * Hand the mutex with ID mid from its owner to its most urgent waiter, or unlock it if
+	 * there are none.
+	 * @param mid ID of the mutex.
+	 */
+	void releaseMutex(int mid);
+
+	/**
+	 * Recompute the effective priority of a thread from its own priority and the waiters of
+	 * the mutexes it holds, and propagate a change along the chain of mutex owners it waits for.
+	 * A queued thread whose priority changed is moved to the ready queue of its new priority.
+	 * @param tid ID of the thread.
 	 */
-	void setTimer(int priority);
+	void refreshPriority(int tid);
 };
 
 
@@ -0,0 +1,176 @@
+#
+# gdb support for the uthreads library: a pretty-printer for Thread, and commands that list the
+# threads and unwind the ones that are switched out, whose registers are only kept (translated)
+# in their sigjmp_buf.
+#
+# Load it with:
+#     (gdb) source tools/uthreads_gdb.py
+# and then:
+#     (gdb) info uthreads          list all the threads
+#     (gdb) uthread bt TID         backtrace of a switched out thread
+#     (gdb) print *Scheduler::me->threads[1]._M_ptr
+#
+# Only x86-64 is supported. Backtraces follow frame pointers, like uthread_dump.
+#
+
+import gdb
+import gdb.printing
+
+JB_BP = 1
+JB_SP = 6
+JB_PC = 7
+POINTER_GUARD_OFFSET = 0x30  # offset of the pointer guard in the thread control block
+MAX_FRAMES = 32
+STATE_NAMES = {0: "READY", 1: "BLOCKED", 2: "TERMINATED"}
+MASK = (1 << 64) - 1
+
+
+def pointer_guard():
+    """The value glibc xors saved registers with, from the thread control block."""
+    fs_base = int(gdb.parse_and_eval("$fs_base"))
+    guard = gdb.selected_inferior().read_memory(fs_base + POINTER_GUARD_OFFSET, 8)
+    return int.from_bytes(bytes(guard), "little")
+
+
+def untranslate(value):
+    """Undo translate_address: rotate right by 0x11, then xor with the pointer guard."""
+    value &= MASK
+    value = ((value >> 0x11) | (value << (64 - 0x11))) & MASK
+    return value ^ pointer_guard()
+
+
+def saved_registers(thread):
+    """The (pc, sp, bp) a thread was switched out with."""
+    registers = thread["environment"][0]["__jmpbuf"]
+    return (untranslate(int(registers[JB_PC])), untranslate(int(registers[JB_SP])),
+            untranslate(int(registers[JB_BP])))
+
+
+def describe_pc(pc):
+    """Function and source line of a return address, or its raw value."""
+    # A return address points after the call, so look up the byte before it:
+    line = gdb.find_pc_line(pc - 1)
+    block = gdb.block_for_pc(pc - 1)
+    while block is not None and block.function is None:
+        block = block.superblock
+    text = "0x%x" % pc
+    if block is not None:
+        text += " in %s" % block.function.print_name
+    if line.symtab is not None:
+        text += " at %s:%d" % (line.symtab.filename, line.line)
+    return text
+
+
+def unwrap(shared_ptr):
+    """The object a std::shared_ptr points to, or None."""
+    pointer = shared_ptr["_M_ptr"]
+    if int(pointer) == 0:
+        return None
+    return pointer.dereference()
+
+
+def scheduler():
+    me = gdb.parse_and_eval("Scheduler::me")
+    if int(me) == 0:
+        raise gdb.GdbError("uthreads is not initialized")
+    return me.dereference()
+
+
+def backtrace(thread):
+    """Yield the return addresses of a switched out thread, innermost first."""
+    pc, _, fp = saved_registers(thread)
+    yield pc
+    memory = gdb.selected_inferior()
+    for _ in range(MAX_FRAMES - 1):
+        if fp == 0 or fp % 8 != 0:
+            return
+        try:
+            frame = bytes(memory.read_memory(fp, 16))
+        except gdb.MemoryError:
+            return
+        next_fp = int.from_bytes(frame[:8], "little")
+        pc = int.from_bytes(frame[8:], "little")
+        if pc == 0:
+            return
+        yield pc
+        if next_fp <= fp:
+            return
+        fp = next_fp
+
+
+class ThreadPrinter(object):
+    """Print a Thread with its saved registers translated back."""
+
+    def __init__(self, value):
+        self.value = value
+
+    def to_string(self):
+        pc, sp, _ = saved_registers(self.value)
+        return "Thread %d, own priority %d, waiting for mutex %d, saved sp 0x%x, pc %s" % (
+            int(self.value["id"]), int(self.value["basePriority"]),
+            int(self.value["waitingOn"]), sp, describe_pc(pc))
+
+
+class InfoUthreads(gdb.Command):
+    """List the uthreads: state, effective priority, quantum count and where each stopped."""
+
+    def __init__(self):
+        super(InfoUthreads, self).__init__("info uthreads", gdb.COMMAND_STATUS)
+
+    def invoke(self, argument, from_tty):
+        me = scheduler()
+        table = gdb.parse_and_eval("Scheduler::table")
+        running = unwrap(me["running"])
+        running_id = int(running["id"]) if running is not None else -1
+        threads = me["threads"]
+        for tid in range(threads.type.range()[1] + 1):
+            thread = unwrap(threads[tid])
+            if thread is None:
+                continue
+            state = STATE_NAMES.get(int(table["state"][tid]), "?")
+            if tid == running_id:
+                state = "RUNNING"
+                where = "(use bt)"
+            else:
+                where = describe_pc(saved_registers(thread)[0])
+            gdb.write("%3d %-10s priority %d (own %d) %6d quantums  %s\n" % (
+                tid, state, int(table["priority"][tid]), int(thread["basePriority"]),
+                int(table["totalQuantum"][tid]), where))
+
+
+class Uthread(gdb.Command):
+    """Commands on a single uthread."""
+
+    def __init__(self):
+        super(Uthread, self).__init__("uthread", gdb.COMMAND_STACK, prefix=True)
+
+
+class UthreadBacktrace(gdb.Command):
+    """uthread bt TID: backtrace of the switched out uthread TID."""
+
+    def __init__(self):
+        super(UthreadBacktrace, self).__init__("uthread bt", gdb.COMMAND_STACK)
+
+    def invoke(self, argument, from_tty):
+        tid = int(gdb.parse_and_eval(argument))
+        me = scheduler()
+        thread = unwrap(me["threads"][tid])
+        if thread is None:
+            raise gdb.GdbError("no uthread %d" % tid)
+        running = unwrap(me["running"])
+        if running is not None and int(running["id"]) == tid:
+            raise gdb.GdbError("uthread %d is running, use bt" % tid)
+        for depth, pc in enumerate(backtrace(thread)):
+            gdb.write("#%-2d %s\n" % (depth, describe_pc(pc)))
+
+
+def build_pretty_printer():
+    printer = gdb.printing.RegexpCollectionPrettyPrinter("uthreads")
+    printer.add_printer("Thread", "^Thread$", ThreadPrinter)
+    return printer
+
+
+gdb.printing.register_pretty_printer(gdb.current_objfile(), build_pretty_printer())
+InfoUthreads()
+Uthread()
+UthreadBacktrace()
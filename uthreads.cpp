@@ -9,9 +9,51 @@
 static std::shared_ptr<Scheduler> scheduler;
 static sigset_t maskSignals;
 
+/*
+ * Number of times the library was shut down. A call that may switch threads compares it before
+ * and after: if it changed, another thread shut the library down and the main thread was resumed
+ * in the call, so its scheduler is gone and the call failed.
+ */
+static unsigned int shutdowns;
+
+
+/**
+ * Block the timer signal, so that the scheduler is not preempted while it is being called.
+ * Cooperative builds have no timer signal, so there is nothing to block.
+ */
+static inline void maskTimer()
+{
+#ifndef UTHREADS_COOPERATIVE
+	if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
+	{
+		std::cerr << SYS_ERROR_SIGPROCMASK;
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
+
+/**
+ * Unblock the timer signal blocked by maskTimer.
+ */
+static inline void unmaskTimer()
+{
+#ifndef UTHREADS_COOPERATIVE
+	if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
+	{
+		std::cerr << SYS_ERROR_SIGPROCMASK;
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
+
 
 int uthread_init(int *quantum_usecs, int size)
 {
+    if (scheduler != nullptr)
+    {
+        std::cerr << TLERROR_INIT_ALREADY_INITIALIZED;
+        return -1;
+    }
     if (size <= 0)
     {
         std::cerr << TLERROR_INIT_NO_QUANTUMS;
@@ -39,6 +81,28 @@ int uthread_init(int *quantum_usecs, int size)
     return 0;
 }
 
+int uthread_shutdown()
+{
+    if (scheduler == nullptr)
+    {
+        std::cerr << TLERROR_SHUTDOWN_NOT_INITIALIZED;
+        return -1;
+    }
+	maskTimer();
+
+	// Destroy the scheduler, then get back to the main thread if we are not on it:
+	bool resumeMain = scheduler->shutdown();
+	scheduler.reset();
+	++shutdowns;
+	if (resumeMain)
+	{
+		Scheduler::resumeMain();
+	}
+
+	unmaskTimer();
+	return 0;
+}
+
 int uthread_spawn(void (*f)(), int priority)
 {
     if (priority < 0)
@@ -46,98 +110,102 @@ int uthread_spawn(void (*f)(), int priority)
         std::cerr << TLERROR_SPAWN_NEGATIVE_PRIORITY;
         return -1;
     }
-    if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}
+    maskTimer();
 
     // Add the thread:
     int result = scheduler->addThread(f, priority);
 
-    if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}
+    unmaskTimer();
 	return result;
 }
 
 int uthread_change_priority(int tid, int priority)
 {
-	if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(1);
-
-	}
+	maskTimer();
 
 	// Change the priority:
 	int result = scheduler->changePriority(tid, priority);
 
-	if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}	
+	unmaskTimer();
 	return result;
 }
 
 int uthread_terminate(int tid)
 {
-	if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}
+	maskTimer();
 
 	// Terminate the thread:
 	int result = scheduler->terminate(tid);
 
-	if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}    
+	unmaskTimer();
 	return result;
 }
 
 int uthread_block(int tid)
 {
-	if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}
+	maskTimer();
 
-	// Block the thread:
+	// Block the thread, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
 	int result = scheduler->block(tid);
 
-	if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}    
-	return result;
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
 }
 
 int uthread_resume(int tid)
 {
-	if(sigprocmask(SIG_BLOCK, &maskSignals, nullptr))
-	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
-	}
+	maskTimer();
 
-	// Resume the thread:
+	// Resume the thread, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
 	int result = scheduler->resume(tid);
 
-	if(sigprocmask(SIG_UNBLOCK, &maskSignals, nullptr))
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
+}
+
+int uthread_post_resume(int tid)
+{
+	if (tid < 0 || tid >= MAX_THREAD_NUM)
 	{
-		std::cerr << SYS_ERROR_SIGPROCMASK;
-		exit(EXIT_FAILURE);
+		// This may run in a signal handler, so avoid the streams:
+		ssize_t ignored = write(STDERR_FILENO, POST_RESUME_ERR_MSG, strlen(POST_RESUME_ERR_MSG));
+		(void) ignored;
+		return -1;
 	}
-	return result;
+	// Queue the request for the next scheduling point, without touching the scheduler:
+	Scheduler::wakeups.post(tid);
+	return 0;
+}
+
+int uthread_wakeup_fd()
+{
+	return Scheduler::wakeups.getDoorbell();
+}
+
+int uthread_wait_fd(int fd, int events)
+{
+	maskTimer();
+
+	// Wait for the file descriptor, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
+	int result = scheduler->waitFd(fd, events);
+
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
+}
+
+int uthread_yield()
+{
+	maskTimer();
+
+	// Give up the rest of the quantum, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
+	int result = scheduler->yield();
+
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
 }
 
 int uthread_get_tid()
@@ -153,4 +221,207 @@ int uthread_get_total_quantums()
 int uthread_get_quantums(int tid)
 {
     return scheduler->getThreadsQuantums(tid);
+}
+
+int uthread_read_snapshot(const struct uthread_snapshot *source, struct uthread_snapshot *copy)
+{
+	// Readers never touch the scheduler, so there is nothing to mask:
+	return Scheduler::snapshot.read(source, copy);
+}
+
+int uthread_share_snapshot(const char *name)
+{
+	maskTimer();
+
+	// Move the snapshot while the scheduler cannot update it:
+	int result = Scheduler::snapshot.share(name);
+
+	unmaskTimer();
+	return result;
+}
+
+const struct uthread_snapshot *uthread_open_snapshot(const char *name)
+{
+	int fd = name == nullptr ? -1 : shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		std::cerr << SNAPSHOT_OPEN_ERR_MSG << (name == nullptr ? "(null)" : name) << ": "
+				  << strerror(errno) << ".\n";
+		return nullptr;
+	}
+	struct stat status = {};
+	void *region = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && status.st_size == sizeof(uthread_snapshot))
+	{
+		region = mmap(nullptr, sizeof(uthread_snapshot), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		// A different size means a library with a different MAX_THREAD_NUM:
+		std::cerr << SNAPSHOT_OPEN_ERR_MSG << name << ": Not a snapshot of this library.\n";
+		return nullptr;
+	}
+	return (const uthread_snapshot *) region;
+}
+
+int uthread_close_snapshot(const struct uthread_snapshot *snapshot)
+{
+	if (snapshot == nullptr || munmap((void *) snapshot, sizeof(uthread_snapshot)) < 0)
+	{
+		std::cerr << TLERROR_SNAPSHOT_CLOSE;
+		return -1;
+	}
+	return 0;
+}
+
+int uthread_set_pool_capacity(int capacity)
+{
+	maskTimer();
+
+	// Resize the pool:
+	int result = scheduler->setPoolCapacity(capacity);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_set_deadline(int tid, int deadline_usecs, int budget_usecs)
+{
+	maskTimer();
+
+	// Set the deadline class parameters, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
+	int result = scheduler->setDeadline(tid, deadline_usecs, budget_usecs);
+
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
+}
+
+int uthread_set_affinity(int cpu)
+{
+	maskTimer();
+
+	// Pin to the cpu:
+	int result = scheduler->setAffinity(cpu);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_set_growable_stacks(int initial_size, int max_size)
+{
+	maskTimer();
+
+	// Switch the kind of stacks new threads get:
+	int result = scheduler->setGrowableStacks(initial_size, max_size);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_set_adaptive_quantum(int min_usecs, int max_usecs)
+{
+	maskTimer();
+
+	// Switch between adaptive and fixed quantums:
+	int result = scheduler->setAdaptiveQuantum(min_usecs, max_usecs);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_get_stats(int tid, struct uthread_stats *stats)
+{
+	maskTimer();
+
+	// Get the statistics of the thread:
+	int result = scheduler->getStats(tid, stats);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_set_aging(int quanta)
+{
+	maskTimer();
+
+	// Set the aging rate:
+	int result = scheduler->setAging(quanta);
+
+	unmaskTimer();
+	return result;
+}
+
+void *uthread_arena_alloc(size_t size, size_t alignment)
+{
+	// Only the calling thread allocates from its arena, so there is no need to mask the timer:
+	return scheduler->arenaAllocate(size, alignment);
+}
+
+int uthread_dump(int fd)
+{
+	maskTimer();
+
+	// Write the report:
+	int result = scheduler->dump(fd);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_set_dump_signal(int signum)
+{
+	maskTimer();
+
+	// Set the signal to dump on:
+	int result = scheduler->setDumpSignal(signum);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_mutex_create()
+{
+	maskTimer();
+
+	// Create the mutex:
+	int result = scheduler->createMutex();
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_mutex_destroy(int mid)
+{
+	maskTimer();
+
+	// Destroy the mutex:
+	int result = scheduler->destroyMutex(mid);
+
+	unmaskTimer();
+	return result;
+}
+
+int uthread_mutex_lock(int mid)
+{
+	maskTimer();
+
+	// Lock the mutex, waiting for it if needed, unless the library is shut down meanwhile:
+	unsigned int generation = shutdowns;
+	int result = scheduler->lockMutex(mid);
+
+	unmaskTimer();
+	return generation == shutdowns ? result : -1;
+}
+
+int uthread_mutex_unlock(int mid)
+{
+	maskTimer();
+
+	// Unlock the mutex:
+	int result = scheduler->unlockMutex(mid);
+
+	unmaskTimer();
+	return result;
 }
\ No newline at end of file
@@ -6,8 +6,70 @@
  * Author: OS, os@cs.huji.ac.il
  */
 
+#include <stddef.h>
+
+/* The limit may be raised by defining it when building the library and the program, e.g. with
+   -DMAX_THREAD_NUM=4096; both must see the same value. */
+#ifndef MAX_THREAD_NUM
 #define MAX_THREAD_NUM 100 /* maximal number of threads */
-#define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#endif
+#define STACK_SIZE 16384 /* stack size per thread (in bytes) */
+#define MAX_MUTEX_NUM 100 /* maximal number of mutexes */
+
+/*
+ * Scheduling and memory statistics of a thread, as reported by uthread_get_stats.
+ */
+struct uthread_stats
+{
+	int quantums; /* number of quantums the thread started */
+	int quantum_usecs; /* length of the thread's next quantum (in micro-seconds) */
+	int average_run_usecs; /* recent average of the cpu time it ran before switching */
+	int early_end_permille; /* recent share of its runs that ended before the quantum expired */
+	int quantums_grown; /* number of times the adaptive mode lengthened its quantum */
+	int quantums_shrunk; /* number of times the adaptive mode shortened its quantum */
+	long arena_bytes; /* bytes mapped for the thread's arena (see uthread_arena_alloc) */
+};
+
+/*
+ * States of a thread in a snapshot.
+ */
+#define UTHREAD_UNUSED 0 /* there is no thread with this ID */
+#define UTHREAD_READY 1 /* ready or running */
+#define UTHREAD_BLOCKED 2
+
+/*
+ * A thread, as seen by a snapshot.
+ */
+struct uthread_thread_snapshot
+{
+	int state; /* UTHREAD_UNUSED, UTHREAD_READY or UTHREAD_BLOCKED */
+	int priority; /* effective priority (possibly inherited through a mutex) */
+	int quantums; /* number of quantums the thread started */
+};
+
+/*
+ * Snapshot of the threads and counters of the library, as read by
+ * uthread_read_snapshot.
+ */
+struct uthread_snapshot
+{
+	unsigned int sequence; /* odd while the library is updating the snapshot */
+	int max_threads; /* MAX_THREAD_NUM of the library that wrote the snapshot */
+	int total_quantums; /* number of quantums since the library was initialized */
+	int running_tid; /* ID of the running thread, or -1 if not initialized */
+	int num_of_threads; /* number of threads that are not UTHREAD_UNUSED */
+	struct uthread_thread_snapshot threads[MAX_THREAD_NUM]; /* by thread ID */
+};
+
+/*
+ * Cooperative builds: when the library is built with UTHREADS_COOPERATIVE
+ * defined (the UTHREADS_COOPERATIVE CMake option, or make COOPERATIVE=1),
+ * threads are never preempted. They switch only when they yield, block or
+ * terminate themselves, or wait for a mutex. No signal is used: the library
+ * sets no timer and no SIGVTALRM action, the functions below do not change the
+ * signal mask, and switches do not save or restore it. Quantums never expire,
+ * so deadline budgets are not charged and adaptive quantums have no effect.
+ */
 
 /* External interface */
 
@@ -15,7 +77,8 @@
 /*
  * Description: This function initializes the thread library.
  * You may assume that this function is called before any other thread library
- * function, and that it is called exactly once. The input to the function is
+ * function. It is an error to call it again unless the library was shut down
+ * with uthread_shutdown in between. The input to the function is
  * an array of the length of a quantum in micro-seconds for each priority. 
  * It is an error to call this function with an array containing non-positive integer.
  * size - is the size of the array.
@@ -23,6 +86,22 @@
 */
 int uthread_init(int *quantum_usecs, int size);
 
+/*
+ * Description: This function shuts the thread library down without exiting
+ * the process. Preemption is stopped, the previous SIGVTALRM action is
+ * restored, and all threads are terminated and their resources released.
+ * If called from the main thread, the function returns to it. If called from
+ * another thread, the function does not return: the main thread continues from
+ * where it last stopped running, and the caller's stack is released by the
+ * next uthread_init. If the main thread stopped in a call (e.g. waiting for a
+ * mutex or a file descriptor), that call returns -1. The library may be
+ * initialized again with uthread_init. It is an error to call this function
+ * when the library is not initialized.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_shutdown();
+
+
 /*
  * Description: This function creates a new thread, whose entry point is the
  * function f with the signature void f(void). The thread is added to the end
@@ -82,6 +161,61 @@ int uthread_block(int tid);
 int uthread_resume(int tid);
 
 
+/*
+ * Description: This function posts a request to resume the thread with ID
+ * tid. Unlike uthread_resume, it may be called from any kernel thread and from
+ * signal handlers, including before uthread_init. Requests are applied in
+ * batches at the next scheduling point (a quantum expiring, or a thread
+ * yielding, blocking or terminating itself): a thread that is blocked by then
+ * is resumed as with uthread_resume, and the request is dropped otherwise. A
+ * request posted while one for the same thread is pending has no effect.
+ * Other kernel threads calling this function must block SIGVTALRM, so that the
+ * library's timer signal is only delivered to the thread running the threads.
+ * It is an error if tid is not in [0, MAX_THREAD_NUM).
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_post_resume(int tid);
+
+
+/*
+ * Description: This function returns a file descriptor that becomes readable
+ * when resume requests were posted with uthread_post_resume, e.g. so that a
+ * main thread waiting in poll(2) for other work also wakes up for them. It is
+ * cleared when the requests are applied, so after it became readable the
+ * caller should reach a scheduling point, e.g. by calling uthread_yield. The
+ * descriptor must not be read from or closed.
+ * Return value: The file descriptor.
+*/
+int uthread_wakeup_fd();
+
+
+/*
+ * Description: This function blocks the calling thread until the file
+ * descriptor fd is ready for the events, a mask of POLLIN and POLLOUT from
+ * poll.h. Other threads run in the meantime. The descriptors that threads wait
+ * for are checked at every scheduling point, and when no thread is READY the
+ * process sleeps until one of them (or a posted resume) is ready. The main
+ * thread may wait too. A waiting thread is not resumed by uthread_resume or
+ * uthread_post_resume. It is an error if fd is not a descriptor that can be
+ * polled (e.g. a regular file), if another thread is already waiting for it,
+ * or if events has other bits. fd should be non-blocking, so that the I/O it
+ * was waiting for does not block all the threads when it was not complete.
+ * Return value: On success, return the events fd is ready for, possibly
+ * including POLLERR and POLLHUP. On failure, return -1.
+*/
+int uthread_wait_fd(int fd, int events);
+
+
+/*
+ * Description: This function moves the calling thread to the end of the
+ * READY threads list and makes a scheduling decision, as if its quantum had
+ * expired. If no other thread is READY, the calling thread keeps running and
+ * its timer is restarted.
+ * Return value: On success, return 0.
+*/
+int uthread_yield();
+
+
 /*
  * Description: This function returns the thread ID of the calling thread.
  * Return value: The ID of the calling thread.
@@ -112,5 +246,251 @@ int uthread_get_total_quantums();
 */
 int uthread_get_quantums(int tid);
 
-#endif
 
+/*
+ * Description: This function copies a consistent snapshot of all the threads
+ * and counters into copy. The library keeps the snapshot up to date as it
+ * schedules, behind a sequence lock, so reading it takes no lock, blocks no
+ * signal and never delays the threads: a reader only retries if it raced with
+ * an update. It may be called from any kernel thread, including before
+ * uthread_init, and from other processes on a snapshot shared with
+ * uthread_share_snapshot and opened with uthread_open_snapshot.
+ * source - The snapshot to read, or NULL for this process's.
+ * Return value: On success, return 0. On failure (e.g. the process writing the
+ * snapshot died in the middle of an update), return -1.
+*/
+int uthread_read_snapshot(const struct uthread_snapshot *source, struct uthread_snapshot *copy);
+
+
+/*
+ * Description: This function moves the snapshot of this process into the
+ * POSIX shared memory object name (see shm_open(3)), created if needed and
+ * readable by all users, so that monitors in other processes can open it with
+ * uthread_open_snapshot. The snapshot stays in the object for the rest of the
+ * process, so it can be shared once only; if name is NULL, the object is
+ * unlinked, and processes that have it open keep reading it.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_share_snapshot(const char *name);
+
+
+/*
+ * Description: This function maps, read only, the snapshot shared by another
+ * process under name, for uthread_read_snapshot. It is an error if the other
+ * process was built with a different MAX_THREAD_NUM.
+ * Return value: On success, return the snapshot, to be released with
+ * uthread_close_snapshot. On failure, return NULL.
+*/
+const struct uthread_snapshot *uthread_open_snapshot(const char *name);
+
+
+/*
+ * Description: This function unmaps a snapshot opened with
+ * uthread_open_snapshot.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_close_snapshot(const struct uthread_snapshot *snapshot);
+
+
+/*
+ * Description: This function sets the capacity of the pool of recycled
+ * threads. When the capacity is positive, the control block, stack and
+ * environment of a terminated thread are kept (up to capacity threads) and
+ * re-initialized for the next uthread_spawn instead of being freed and
+ * allocated again. The pool is filled up to capacity when this function is
+ * called. A capacity of 0 (the default) disables the pool and releases all
+ * parked threads. It is an error to call this function with a negative
+ * capacity.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_pool_capacity(int capacity);
+
+
+/*
+ * Description: This function moves the thread with ID tid into the deadline
+ * scheduling class, with a relative deadline of deadline_usecs micro-seconds
+ * and a runtime budget of budget_usecs micro-seconds (of cpu time) per
+ * release. A thread is released - given an absolute deadline deadline_usecs
+ * from now and a full budget - when this function is called on it while it is
+ * not blocked, and every time it is resumed. Released threads run before all
+ * other threads, the earliest absolute deadline first, and a released thread
+ * preempts the caller of uthread_resume or of this function if its deadline
+ * is earlier. A thread that uses up its budget before blocking is throttled:
+ * it is scheduled like any other thread until its next release. Passing a
+ * deadline_usecs of 0 moves the thread back to the normal classes. It is an
+ * error to pass a negative deadline, or a non-positive budget with a positive
+ * deadline.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_deadline(int tid, int deadline_usecs, int budget_usecs);
+
+
+/*
+ * Description: This function pins the process's kernel thread, on which all
+ * the threads run, to the cpu with number cpu, so that threads keep their
+ * caches warm and memory allocated from now on is local to that cpu's memory
+ * node. The stacks of threads parked in the pool are faulted in again after
+ * pinning, so they are local to that node as well. It is an
+ * error to pin to a cpu that does not exist or is not available to the process.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_affinity(int cpu);
+
+
+/*
+ * Description: This function makes threads spawned from now on use growable
+ * stacks: each stack starts with initial_size bytes, and grows on demand, up
+ * to max_size bytes, when the thread runs past it. Memory is only committed
+ * for the part of a stack that was actually used, so threads that recurse
+ * deeply can have large stacks without every thread paying for them. A thread
+ * that runs past max_size crashes the process with SIGSEGV, as does any other
+ * invalid memory access. Growth is handled by a SIGSEGV handler that runs on an
+ * alternate signal stack and stays installed; faults it does not handle are
+ * passed on to the SIGSEGV action that was set before. If both sizes are 0,
+ * threads spawned from now on get fixed stacks of STACK_SIZE bytes again
+ * (the default). Threads parked in the pool are reallocated with the new kind
+ * of stack. It is an error if max_size is smaller than initial_size, or if
+ * only one of them is 0.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_growable_stacks(int initial_size, int max_size);
+
+
+/*
+ * Description: This function makes the quantum of each thread adapt to how
+ * the thread behaves, instead of being fixed by its priority. Each thread
+ * starts from the quantum of its priority (also after its priority is
+ * changed), clamped to [min_usecs, max_usecs]. When a thread's quantum expires,
+ * its next quantum is twice as long, so CPU-bound threads are switched less
+ * often. When most of a thread's recent runs ended early because it blocked
+ * or yielded, its next quantum is twice its recent average run, so it does not
+ * hold on to a long slice it does not use. Quantums always stay within the
+ * bounds. If both bounds are 0, the fixed quantums of the priorities are used
+ * again (the default). It is an error if max_usecs is smaller than min_usecs,
+ * or if only one of them is 0.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_adaptive_quantum(int min_usecs, int max_usecs);
+
+
+/*
+ * Description: This function fills stats with the scheduling statistics of
+ * the thread with ID tid. The average run and the share of early ends are only
+ * tracked while quantums are adaptive. If no thread with ID tid exists it is
+ * considered an error.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_get_stats(int tid, struct uthread_stats *stats);
+
+
+/*
+ * Description: This function makes priorities affect the order in which
+ * READY threads run, with aging so that no thread starves. Every priority has
+ * its own ready queue, and the next thread to run is the head of a queue with
+ * the lowest key: the total quantum count when the thread was queued, plus its
+ * priority times quanta. A thread of priority p therefore runs before any
+ * thread of priority 0 that was queued more than p * quanta quantums after it.
+ * A READY thread whose priority changes, by uthread_change_priority or while
+ * threads wait for a mutex it holds, moves to the queue of its new priority
+ * and keeps the time it was queued at. With quanta 0 (the default) the order
+ * is first come, first served, regardless of priority.
+ * Threads in the deadline class are not affected. It is an error to pass a
+ * negative quanta.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_aging(int quanta);
+
+
+/*
+ * Description: This function allocates size bytes, aligned to alignment (a
+ * power of two), from the arena of the calling thread. The arena is a bump
+ * allocator: memory taken from it is not freed one allocation at a time, but
+ * all at once when the thread terminates (for the main thread, when the
+ * library shuts down). Each thread has its own arena, mapped from the system
+ * in growing chunks on first use, so allocating takes no lock and does not
+ * block the timer signal. arenaAllocator.h adapts it to STL containers.
+ * Memory from a thread's arena may be used by other threads, but must not be
+ * used after that thread terminated.
+ * Return value: On success, return a pointer to the memory. On failure,
+ * return NULL.
+*/
+void *uthread_arena_alloc(size_t size, size_t alignment);
+
+
+/*
+ * Description: This function writes a report of all the threads to the file
+ * descriptor fd: for each thread its state, priority (effective and own),
+ * quantum count, the mutexes it waits for or holds, and a backtrace from where
+ * it stopped running (for the calling thread, from the call). Backtraces follow
+ * frame pointers, so code built without them (-fomit-frame-pointer, the default
+ * at higher optimization levels) yields short backtraces. Functions are named
+ * when the dynamic linker knows them (e.g. the executable is linked with
+ * -rdynamic); otherwise the object file and offset are given, for addr2line.
+ * It is an error to pass a negative fd.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_dump(int fd);
+
+
+/*
+ * Description: This function makes the library write the report of
+ * uthread_dump to stderr whenever the process receives the signal signum,
+ * e.g. from kill(1). The report is written once a thread yields, blocks or
+ * terminates itself after the signal arrives, or once the signal interrupts
+ * the library's sleep while every thread waits for a descriptor. If a quantum
+ * expires first, the report is written from the timer's signal handler
+ * instead, with frames given by address only (for addr2line), so threads that
+ * never yield are dumped too. If signum is 0, the previous action of
+ * the dump signal is restored. It is an error to pass SIGVTALRM,
+ * SIGSEGV, SIGKILL, SIGSTOP, or a number that is not a signal.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_dump_signal(int signum);
+
+
+/*
+ * Description: This function creates a new mutex. Mutexes implement priority
+ * inheritance: while a thread waits for a mutex, the thread holding it runs
+ * with the waiter's priority (and quantum) if it is more urgent than its own,
+ * where a numerically lower priority is more urgent. The boost propagates
+ * along chains of threads waiting for each other, and is dropped when the
+ * mutex is unlocked. It is an error to create more than MAX_MUTEX_NUM mutexes.
+ * Return value: On success, return the ID of the created mutex.
+ * On failure, return -1.
+*/
+int uthread_mutex_create();
+
+
+/*
+ * Description: This function destroys the mutex with ID mid. It is an error
+ * to destroy a mutex that does not exist or is locked.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_destroy(int mid);
+
+
+/*
+ * Description: This function locks the mutex with ID mid. If the mutex is
+ * held by another thread, the calling thread waits until the mutex is handed
+ * to it, and a scheduling decision is made. A waiting thread is not affected
+ * by uthread_resume. The main thread may wait too; if then no thread can run
+ * and none could be woken (no thread waits for a file descriptor, and the
+ * process has no other kernel thread to post a resume), the library reports
+ * the deadlock and exits the program with EXIT_FAILURE. It is an error to
+ * lock a mutex that does not exist or that is already held by the calling
+ * thread.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_lock(int mid);
+
+
+/*
+ * Description: This function unlocks the mutex with ID mid, which must be held
+ * by the calling thread. If threads are waiting for the mutex, it is handed to
+ * the waiter with the most urgent priority (the earliest among equals), which
+ * is moved to the READY state.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_unlock(int mid);
+
+#endif
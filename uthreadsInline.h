@@ -0,0 +1,45 @@
+//
+// Inline fast paths of the uthreads library, for the calls a program makes most often.
+//
+// uthread_yield has no fast path, since it always counts a quantum and restarts the timer; build
+// with UTHREADS_LTO to have it and the other calls inlined into the program instead.
+//
+
+#ifndef THREADS_UTHREADSINLINE_H
+#define THREADS_UTHREADSINLINE_H
+
+#include "uthreads.h"
+#include <atomic>
+
+/*
+ * The snapshot the library keeps up to date (see uthread_read_snapshot). Its writer is the kernel
+ * thread that runs the threads, so to a running thread its running_tid and states are always
+ * current. Read it only through the functions below.
+ */
+extern std::atomic<uthread_snapshot *> uthread_live_snapshot;
+
+/**
+ * Same as uthread_get_tid, in a couple of loads instead of a call into the library.
+ */
+inline int uthread_get_tid_inline()
+{
+	const uthread_snapshot *live = uthread_live_snapshot.load(std::memory_order_relaxed);
+	return __atomic_load_n(&live->running_tid, __ATOMIC_RELAXED);
+}
+
+/**
+ * Same as uthread_resume. Resuming a thread that is ready does nothing, so that case is answered
+ * here without masking the timer; only blocked and missing threads go to the library.
+ */
+inline int uthread_resume_inline(int tid)
+{
+	const uthread_snapshot *live = uthread_live_snapshot.load(std::memory_order_relaxed);
+	if (tid >= 0 && tid < MAX_THREAD_NUM &&
+		__atomic_load_n(&live->threads[tid].state, __ATOMIC_RELAXED) == UTHREAD_READY)
+	{
+		return 0;
+	}
+	return uthread_resume(tid);
+}
+
+#endif //THREADS_UTHREADSINLINE_H